@@ -15,19 +15,63 @@
 #define YAZ0_NEED_AVAIL_OUT 2
 #define YAZ0_BAD_MAGIC      (-1)
 #define YAZ0_OUT_OF_MEMORY  (-2)
+#define YAZ0_BAD_DATA       (-3)
+#define YAZ0_BAD_MODE       (-4)
 
 #define YAZ0_DEFAULT_LEVEL  6
+#define YAZ0_MAX_LEVEL      10
+#define YAZ0_SIZE_UNKNOWN   0xffffffff
+
+#define YAZ0_STRATEGY_DEFAULT       0
+#define YAZ0_STRATEGY_DECODE_SPEED  1
 
 typedef struct Yaz0Stream Yaz0Stream;
+typedef void (*Yaz0SinkFunc)(void* userdata, const void* data, uint32_t size);
+
+typedef struct
+{
+    const void* in;
+    uint32_t    sizeIn;
+    void*       out;
+    uint32_t    sizeOut;
+    uint32_t    decompSize;
+    int         result;
+    int         strict;
+} Yaz0BatchJob;
+
+typedef struct
+{
+    uint32_t    size;   /* Compressed size, header included */
+    uint32_t    time;   /* Compression time, in microseconds */
+} Yaz0Estimate;
 
 YAZ0_API int yaz0Init(Yaz0Stream** stream);
 YAZ0_API int yaz0Destroy(Yaz0Stream* stream);
 YAZ0_API int yaz0ModeDecompress(Yaz0Stream* stream);
 YAZ0_API int yaz0ModeCompress(Yaz0Stream* stream, uint32_t size, int level);
+YAZ0_API int yay0ModeDecompress(Yaz0Stream* stream);
+YAZ0_API int yay0ModeCompress(Yaz0Stream* stream, uint32_t size, int level);
+YAZ0_API int yaz0Strategy(Yaz0Stream* stream, int strategy);
+YAZ0_API int yaz0Strict(Yaz0Stream* stream, int strict);
 YAZ0_API int yaz0Run(Yaz0Stream* stream);
 YAZ0_API int yaz0Input(Yaz0Stream* stream, const void* data, uint32_t size);
+/* No more input will come. Strict decompression only returns YAZ0_OK after it */
+YAZ0_API int yaz0InputEnd(Yaz0Stream* stream);
 YAZ0_API int yaz0Output(Yaz0Stream* stream, void* data, uint32_t size);
+/* Decompression only. Set it after yaz0ModeDecompress, which clears it */
+YAZ0_API int yaz0OutputSink(Yaz0Stream* stream, Yaz0SinkFunc func, void* userdata);
+
+/* Decodes each job whole, one after another, the jobs split by input size across threads */
+YAZ0_API int yaz0DecompressBatch(Yaz0BatchJob* jobs, uint32_t count, int threads);
+YAZ0_API int yaz0DecompressParallel(Yaz0BatchJob* job, int threads);
+/* Ends the worker threads kept between calls, e.g. before unloading a library holding libyaz0 */
+YAZ0_API int yaz0StopThreads(void);
+
+YAZ0_API int yaz0Estimate(const void* data, uint32_t size, int level, Yaz0Estimate* estimate);
+/* Returns YAZ0_NEED_AVAIL_OUT if out is too small, with outSize set to the size needed */
+YAZ0_API int yaz0Recompress(const void* in, uint32_t sizeIn, void* out, uint32_t sizeOut, uint32_t* outSize, int level);
 
+YAZ0_API int yaz0Header(const Yaz0Stream* stream, void* out);
 YAZ0_API uint32_t yaz0OutputChunkSize(const Yaz0Stream* stream);
 YAZ0_API uint32_t yaz0DecompressedSize(const Yaz0Stream* stream);
 
@@ -0,0 +1,132 @@
+#include <string.h>
+#include "flat.h"
+
+/*
+ * Many small streams at once. Each thread takes a run of jobs of about the
+ * same total input size, and decodes them one after the other. Decoding
+ * several of them group by group in lanes, to overlap their loads, was
+ * slower than one at a time, so there is nothing more to it.
+ */
+typedef struct
+{
+    Yaz0BatchJob*   jobs;
+    uint32_t        count;
+} BatchSlice;
+
+int yaz0_StartJob(Yaz0BatchJob* job)
+{
+    const uint8_t* in;
+    uint32_t size;
+    uint32_t linkOffset;
+    uint32_t chunkOffset;
+
+    in = job->in;
+    chunkOffset = 0;
+    job->decompSize = 0;
+    /* A job holds all of its input, so in strict mode a short one is truncated */
+    if (job->sizeIn < 16)
+    {
+        job->result = job->strict ? YAZ0_BAD_DATA : YAZ0_NEED_AVAIL_IN;
+        return 0;
+    }
+    if (memcmp(in, "Yaz0", 4) && memcmp(in, "Yay0", 4))
+    {
+        job->result = YAZ0_BAD_MAGIC;
+        return 0;
+    }
+    if (!memcmp(in, "Yay0", 4))
+    {
+        linkOffset = read32(in + 8);
+        chunkOffset = read32(in + 12);
+        if (linkOffset < 16 || chunkOffset < linkOffset)
+        {
+            job->result = YAZ0_BAD_MAGIC;
+            return 0;
+        }
+        if (chunkOffset > job->sizeIn)
+        {
+            job->result = job->strict ? YAZ0_BAD_DATA : YAZ0_NEED_AVAIL_IN;
+            return 0;
+        }
+    }
+    size = read32(in + 4);
+    job->decompSize = size;
+    if (size > job->sizeOut)
+    {
+        job->result = YAZ0_NEED_AVAIL_OUT;
+        return 0;
+    }
+    if (!size)
+    {
+        job->result = job->strict ? yaz0_CheckTrailing(in, memcmp(in, "Yay0", 4) ? 16 : chunkOffset, job->sizeIn) : YAZ0_OK;
+        return 0;
+    }
+    return 1;
+}
+
+static void decodeSlice(void* arg)
+{
+    BatchSlice* slice;
+    Yaz0BatchJob* job;
+    FlatDecoder dec;
+    int done;
+
+    slice = arg;
+    for (uint32_t i = 0; i < slice->count; ++i)
+    {
+        job = &slice->jobs[i];
+        if (!yaz0_StartJob(job))
+            continue;
+        flatInit(&dec, job->in, job->sizeIn, job->out, job->decompSize, job->strict);
+        done = 0;
+        while (!done)
+            done = dec.yay0 ? flatDecodeWordYay0(&dec, flatNoLiterals, flatCopyMatch) : flatDecodeGroup(&dec, flatNoLiterals, flatCopyMatch);
+        if (dec.result == YAZ0_OK && dec.strict)
+            dec.result = yaz0_CheckTrailing(dec.in, flatEnd(&dec), dec.sizeIn);
+        job->result = dec.result;
+    }
+}
+
+int yaz0DecompressBatch(Yaz0BatchJob* jobs, uint32_t count, int threads)
+{
+    BatchSlice slices[MAX_THREADS];
+    uint64_t total;
+    uint64_t acc;
+    uint64_t target;
+    uint32_t first;
+    uint32_t last;
+    uint32_t sliceCount;
+
+    if (threads < 1)
+        threads = 1;
+    sliceCount = (uint32_t)threads;
+    if (sliceCount > MAX_THREADS)
+        sliceCount = MAX_THREADS;
+    if (sliceCount > count)
+        sliceCount = count;
+
+    /* Split the jobs in slices of about the same input size */
+    total = 0;
+    for (uint32_t i = 0; i < count; ++i)
+        total += jobs[i].sizeIn;
+    acc = 0;
+    first = 0;
+    for (uint32_t t = 0; t < sliceCount; ++t)
+    {
+        target = total * (t + 1) / sliceCount;
+        last = first;
+        while (last < count && (acc < target || t == sliceCount - 1))
+            acc += jobs[last++].sizeIn;
+        slices[t].jobs = jobs + first;
+        slices[t].count = last - first;
+        first = last;
+    }
+    yaz0_RunTasks(decodeSlice, slices, sizeof(*slices), sliceCount);
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (jobs[i].result != YAZ0_OK)
+            return jobs[i].result;
+    }
+    return YAZ0_OK;
+}
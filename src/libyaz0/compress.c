@@ -15,6 +15,33 @@ static const uint32_t kProbesPerLevel[] = {
     0x1000
 };
 
+static const uint32_t kBucketsPerLevel[] = {
+    0,
+    1,
+    1,
+    1,
+    1,
+    2,
+    4,
+    16,
+    32,
+    64
+};
+
+/* A recompression hint this long is taken without searching the tables */
+static const uint32_t kNicePerLevel[] = {
+    0,
+    8,
+    8,
+    16,
+    16,
+    32,
+    32,
+    64,
+    128,
+    0x111
+};
+
 static uint32_t hash(uint8_t a, uint8_t b, uint8_t c)
 {
     uint32_t x = (uint32_t)a | ((uint32_t)b << 8) | ((uint32_t)c << 16);
@@ -23,100 +50,88 @@ static uint32_t hash(uint8_t a, uint8_t b, uint8_t c)
     return x;
 }
 
-static void hashWrite(Yaz0Stream* s, uint32_t h, uint32_t offset)
+static uint32_t bucketTags(const HashBucket* b, uint16_t tag)
 {
-    uint32_t maxProbes;
-    uint32_t bucket;
-    uint32_t tmpBucket;
-    uint32_t oldest;
-    uint32_t entry;
-    int32_t pos;
+#if defined(YAZ0_SSE2)
+    __m128i t;
+    __m128i lo;
+    __m128i hi;
+
+    t = _mm_set1_epi16((short)tag);
+    lo = _mm_cmpeq_epi16(_mm_load_si128((const __m128i*)b->tags), t);
+    hi = _mm_cmpeq_epi16(_mm_load_si128((const __m128i*)(b->tags + 8)), t);
+    return (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(lo, hi));
+#else
+    uint32_t mask;
 
-    oldest = 0xffffffff;
-    maxProbes = kProbesPerLevel[s->level];
-    for (uint32_t i = 0; i < maxProbes; ++i)
+    mask = 0;
+    for (uint32_t i = 0; i < HASH_BUCKET_SLOTS; ++i)
     {
-        tmpBucket = (h + i) % HASH_MAX_ENTRIES;
-        entry = s->htEntries[tmpBucket];
-        if (entry == 0xffffffff)
-        {
-            s->htSize++;
-            bucket = tmpBucket;
-            break;
-        }
-        pos = (int32_t)(s->totalOut - entry);
-        if (pos > 0x1000)
-        {
-            bucket = tmpBucket;
-            break;
-        }
-        if (entry < oldest)
-        {
-            oldest = entry;
-            bucket = tmpBucket;
-        }
+        if (b->tags[i] == tag)
+            mask |= (1u << i);
     }
+    return mask;
+#endif
+}
+
+static void bucketPush(HashBucket* b, uint16_t tag, uint16_t pos)
+{
+#if defined(YAZ0_SSE2)
+    __m128i lo;
+    __m128i hi;
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
-    s->htEntries[bucket] = s->totalOut + offset;
-    s->htHashes[bucket] = h;
-#pragma GCC diagnostic pop
+    lo = _mm_load_si128((const __m128i*)b->tags);
+    hi = _mm_load_si128((const __m128i*)(b->tags + 8));
+    _mm_store_si128((__m128i*)(b->tags + 8), _mm_or_si128(_mm_slli_si128(hi, 2), _mm_srli_si128(lo, 14)));
+    _mm_store_si128((__m128i*)b->tags, _mm_insert_epi16(_mm_slli_si128(lo, 2), (short)tag, 0));
+    lo = _mm_load_si128((const __m128i*)b->pos);
+    hi = _mm_load_si128((const __m128i*)(b->pos + 8));
+    _mm_store_si128((__m128i*)(b->pos + 8), _mm_or_si128(_mm_slli_si128(hi, 2), _mm_srli_si128(lo, 14)));
+    _mm_store_si128((__m128i*)b->pos, _mm_insert_epi16(_mm_slli_si128(lo, 2), (short)pos, 0));
+#else
+    memmove(b->tags + 1, b->tags, sizeof(uint16_t) * (HASH_BUCKET_SLOTS - 1));
+    memmove(b->pos + 1, b->pos, sizeof(uint16_t) * (HASH_BUCKET_SLOTS - 1));
+    b->tags[0] = tag;
+    b->pos[0] = pos;
+#endif
 }
 
-static void rebuildHashTable(Yaz0Stream* s)
+/* Age of an entry - exact as long as the table is swept often enough */
+static __inline uint32_t entryAge(uint16_t now, uint16_t pos)
 {
-    uint32_t entry;
-    uint32_t pos;
-    uint32_t h;
-    uint32_t bucket;
-    uint32_t size;
+    return (uint16_t)(now - pos);
+}
 
-    /* First pass - delete old entries */
-    size = s->htSize;
-    for (uint32_t i = 0; i < HASH_MAX_ENTRIES; ++i)
-    {
-        entry = s->htEntries[i];
-        if (entry == 0xffffffff)
-            continue;
-        pos = s->totalOut - entry;
-        if (pos > 0x1000)
-        {
-            s->htEntries[i] = 0xffffffff;
-            size--;
-        }
-    }
-    s->htSize = size;
+/*
+ * Positions are 16 bits, so they would look recent again after wrapping
+ * around. Every entry past the window is reset to a fixed age well before
+ * that can happen, which keeps the ages exact.
+ */
+static void hashSweep(Yaz0Stream* s)
+{
+    uint16_t now;
+    uint16_t stale;
 
-    /* Second pass - move */
-    for (uint32_t i = 0; i < HASH_MAX_ENTRIES; ++i)
+    now = (uint16_t)s->totalOut;
+    stale = (uint16_t)(now - HASH_STALE);
+    for (uint32_t i = 0; i < HASH_BUCKETS; ++i)
     {
-        entry = s->htEntries[i];
-        if (entry == 0xffffffff)
-            continue;
-
-        /* Entry still good - might need to move */
-        h = s->htHashes[i];
-        bucket = h % HASH_MAX_ENTRIES;
-        while (bucket != i)
+        for (uint32_t j = 0; j < HASH_BUCKET_SLOTS; ++j)
         {
-            if (s->htEntries[bucket] != 0xffffffff)
-            {
-                bucket = (bucket + 1) % HASH_MAX_ENTRIES;
-                continue;
-            }
-            s->htEntries[bucket] = entry;
-            s->htHashes[bucket] = h;
-            s->htEntries[i] = 0xffffffff;
-            break;
+            if (entryAge(now, s->ht[i].pos[j]) > 0x1000)
+                s->ht[i].pos[j] = stale;
         }
+        if (entryAge(now, s->htSpill[i]) > 0x1000)
+            s->htSpill[i] = stale;
     }
+    s->htSweep = s->totalOut + HASH_SWEEP;
 }
 
+
 static uint32_t maxSize(Yaz0Stream* stream)
 {
-    /* the extra byte is for look-aheads */
-    static const uint32_t maxNecessary = 0x888 + 1;
+    /* the extra bytes are for look-aheads and tree insertions */
+    static const uint32_t maxNecessary = 0x888 + 0x111;
     uint32_t max;
 
     max = stream->decompSize - stream->totalOut;
@@ -160,78 +175,406 @@ static int feed(Yaz0Stream* s)
         size = WINDOW_SIZE - s->window_end;
         memcpy(s->window + s->window_end, s->in + s->cursorIn, size);
         s->cursorIn += size;
+        s->totalIn += size;
         s->window_end = 0;
         max -= size;
     }
     memcpy(s->window + s->window_end, s->in + s->cursorIn, max);
     s->cursorIn += max;
+    s->totalIn += max;
     s->window_end += max;
     return ret;
 }
 
+/* How far the window agrees at cursors a and b, from len up to limit */
+FORCE_INLINE uint32_t extendMatch(const uint8_t* window, uint32_t a, uint32_t b, uint32_t len, uint32_t limit)
+{
+#if defined(YAZ0_SSE2)
+    uint32_t mask;
+
+    /* 16 bytes at a time, unless either side wraps around */
+    if (a + limit <= WINDOW_SIZE && b + limit <= WINDOW_SIZE)
+    {
+        while (len + 16 <= limit)
+        {
+            mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i*)(window + a + len)),
+                _mm_loadu_si128((const __m128i*)(window + b + len))));
+            if (mask != 0xffff)
+                return len + ctz(~mask);
+            len += 16;
+        }
+    }
+#endif
+    while (len < limit && window[(a + len) % WINDOW_SIZE] == window[(b + len) % WINDOW_SIZE])
+        len++;
+    return len;
+}
+
 static uint32_t matchSize(Yaz0Stream* s, uint32_t offset, uint32_t pos, uint32_t hintSize)
 {
-    uint32_t size = 0;
     uint32_t start = s->window_start + offset;
     uint32_t cursorA = (start + WINDOW_SIZE - pos) % WINDOW_SIZE;
     uint32_t cursorB = start % WINDOW_SIZE;
     uint32_t maxSize;
 
     maxSize = s->decompSize - s->totalOut;
+    if (maxSize <= offset)
+        return 0;
+    maxSize -= offset;
     if (maxSize > 0x111)
         maxSize = 0x111;
+    if (hintSize >= maxSize)
+        return 0;
     if (hintSize)
     {
         if (s->window[(cursorA + hintSize) % WINDOW_SIZE] != s->window[(cursorB + hintSize) % WINDOW_SIZE])
             return 0;
     }
-    for (;;)
+    return extendMatch(s->window, cursorA, cursorB, 0, maxSize);
+}
+
+/*
+ * Runs of a byte or of a short pattern hash every position to the same
+ * buckets, flooding them with copies of the run that are all as good as
+ * one another. A position that repeats the data up to RUN_PERIOD bytes
+ * back, for a whole period and the two bytes after, is left out of the
+ * tables. Inside a run, the match finder tries the distance of the run
+ * itself instead, and the start of the run is still filed under its bytes
+ * for later runs to match against.
+ *
+ * That loses the positions that end at the same time as a later run does,
+ * and go on matching past it. Each run is filed once more for those, from
+ * its last position, under the byte that breaks it. A run of the same
+ * bytes looks it up and lines up with its end, whatever its length.
+ */
+/* Up to 14, for a period and the two bytes after it to fit in 16 bytes */
+#define RUN_PERIOD  8
+/* Below this a hash has a single bucket, and a run only evicts itself */
+#define RUN_LEVEL   5
+
+/*
+ * Distance of the run offset is inside of, in the low byte, and of the
+ * run it is in or starts, in the next one. The lazy parse asks about each
+ * position a few times over, so the last two answers are kept.
+ */
+FORCE_INLINE uint32_t runDistance(Yaz0Stream* s, uint32_t offset)
+{
+    uint8_t b[32];
+    const uint8_t* w;
+    uint32_t cur;
+    uint32_t avail;
+    uint32_t start;
+    uint32_t dist;
+    uint32_t back;
+    uint32_t ahead;
+#if defined(YAZ0_SSE2)
+    __m128i lo;
+    __m128i hi;
+    __m128i x;
+    uint32_t pairs;
+    uint32_t eq;
+    uint32_t limit;
+#endif
+
+    cur = s->totalOut + offset;
+    if (s->runAt[cur & 1] == cur + 1)
+        return s->runDists[cur & 1];
+
+    /* w[RUN_PERIOD] is at offset, bytes past the data or before it are never looked at */
+    start = (s->window_start + offset + WINDOW_SIZE - RUN_PERIOD) % WINDOW_SIZE;
+    w = s->window + start;
+    if (start + sizeof(b) > WINDOW_SIZE)
+    {
+        for (uint32_t i = 0; i < sizeof(b); ++i)
+            b[i] = s->window[(start + i) % WINDOW_SIZE];
+        w = b;
+    }
+    avail = s->decompSize - cur;
+    back = 0;
+    ahead = 0;
+
+    /* The shortest period wins, so stop at the first of each */
+#if defined(YAZ0_SSE2)
+    /* Bit i of pairs is set if w[i] and w[i + 1] are the two bytes at offset */
+    lo = _mm_loadu_si128((const __m128i*)w);
+    hi = _mm_loadu_si128((const __m128i*)(w + 16));
+    x = _mm_set1_epi8((char)w[RUN_PERIOD]);
+    pairs = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, x)) | ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, x)) << 16);
+    x = _mm_set1_epi8((char)w[RUN_PERIOD + 1]);
+    pairs &= ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, x)) | ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, x)) << 16)) >> 1;
+    limit = avail > RUN_PERIOD + 2 ? RUN_PERIOD : (avail > 2 ? avail - 2 : 0);
+    ahead = (pairs >> RUN_PERIOD) & ((2u << limit) - 2);
+    ahead = ahead ? ctz(ahead) : 0;
+
+    /* Only a pair dist bytes back can start a run, check the rest of its period */
+    if (limit > cur)
+        limit = cur;
+    pairs &= (1u << RUN_PERIOD) - 1;
+    for (dist = 1; pairs && dist <= limit; ++dist)
     {
-        if (s->window[(cursorA + size) % WINDOW_SIZE] != s->window[(cursorB + size) % WINDOW_SIZE])
+        if (!(pairs & (1u << (RUN_PERIOD - dist))))
+            continue;
+        eq = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, _mm_loadu_si128((const __m128i*)(w + dist))));
+        if (((eq >> (RUN_PERIOD - dist)) & ((4u << dist) - 1)) == (4u << dist) - 1)
+        {
+            back = dist;
             break;
-        size++;
-        if (size == maxSize)
+        }
+    }
+#else
+    for (dist = 1; dist <= RUN_PERIOD && dist + 2 <= avail && !(back && ahead); ++dist)
+    {
+        if (!ahead && w[RUN_PERIOD + dist] == w[RUN_PERIOD] && w[RUN_PERIOD + dist + 1] == w[RUN_PERIOD + 1])
+            ahead = dist;
+        if (back || dist > cur || w[RUN_PERIOD - dist] != w[RUN_PERIOD])
+            continue;
+        for (uint32_t i = 1; i < dist + 2; ++i)
+        {
+            if (w[RUN_PERIOD - dist + i] != w[RUN_PERIOD + i])
+                break;
+            if (i == dist + 1)
+                back = dist;
+        }
+    }
+#endif
+    s->runAt[cur & 1] = cur + 1;
+    s->runDists[cur & 1] = (uint16_t)(back | (ahead << 8));
+    return back | (ahead << 8);
+}
+
+/*
+ * Length from offset to the first byte that differs from the one dist
+ * bytes back, or 0 if there is none a match could reach. Positions of a
+ * run ask in turn, so the end found is kept and scanning picks up from it.
+ */
+FORCE_INLINE uint32_t runLength(Yaz0Stream* s, uint32_t offset, uint32_t dist)
+{
+    const uint8_t* w;
+    uint32_t cur;
+    uint32_t end;
+    uint32_t limit;
+    uint32_t i;
+
+    cur = s->totalOut + offset;
+    limit = s->decompSize - cur;
+    if (limit > 0x111)
+        limit = 0x111;
+    limit += cur;
+    if (dist != s->runStep || cur < s->runFrom || cur + dist > s->runEnd)
+    {
+        s->runStep = dist;
+        s->runFrom = cur;
+        s->runEnd = cur + dist;
+    }
+    w = s->window;
+    end = s->runEnd;
+    i = s->window_start + (end - s->totalOut);
+    while (end < limit && w[i % WINDOW_SIZE] == w[(i + WINDOW_SIZE - dist) % WINDOW_SIZE])
+    {
+        end++;
+        i++;
+    }
+    s->runEnd = end;
+    if (end >= limit)
+        return 0;
+    return end - cur;
+}
+
+/* Where the run ending len bytes after offset is filed */
+FORCE_INLINE uint32_t runHash(const Yaz0Stream* s, uint32_t offset, uint32_t dist, uint32_t len)
+{
+    const uint8_t* w;
+    uint32_t start;
+
+    w = s->window;
+    start = s->window_start + offset + len;
+    return hash(w[(start - 3) % WINDOW_SIZE], w[(start - 2) % WINDOW_SIZE], w[(start - 1) % WINDOW_SIZE])
+        ^ (((dist << 8) | w[start % WINDOW_SIZE]) * 0x9e3779b1);
+}
+
+FORCE_INLINE void hashPush(Yaz0Stream* s, uint32_t h, uint32_t offset, int level)
+{
+    HashBucket* bucket;
+    uint32_t maxBuckets;
+    uint16_t now;
+    uint16_t tag;
+    uint16_t pos;
+    uint16_t lastTag;
+    uint16_t lastPos;
+
+    /* Positions are stored as the low 16 bits of totalOut, */
+    /* so anything older than the window reads as stale on its own */
+    now = (uint16_t)(s->totalOut + offset);
+    tag = (uint16_t)(h >> 16);
+    pos = now;
+    maxBuckets = kBucketsPerLevel[level];
+    for (uint32_t i = 0; i < maxBuckets; ++i)
+    {
+        /* Buckets are kept newest first */
+        bucket = s->ht + ((h + i) % HASH_BUCKETS);
+        lastTag = bucket->tags[HASH_BUCKET_SLOTS - 1];
+        lastPos = bucket->pos[HASH_BUCKET_SLOTS - 1];
+        bucketPush(bucket, tag, pos);
+
+        /* Push the evicted entry to the next bucket if still in the window */
+        if (entryAge(now, lastPos) > 0x1000)
             break;
+        s->htSpill[(h + i) % HASH_BUCKETS] = now;
+        tag = lastTag;
+        pos = lastPos;
     }
-    return size;
 }
 
-static void findHashMatch(Yaz0Stream* s, uint32_t h, uint32_t offset, uint32_t* outSize, uint32_t* outPos)
+/* Leave out a position inside a run, or file the run from its last one, returns zero if it is not in one */
+FORCE_INLINE int runWrite(Yaz0Stream* s, uint32_t offset, int level)
 {
-    uint32_t bucket;
-    uint32_t entry;
-    uint32_t bestSize;
-    uint32_t bestPos;
+    uint32_t dist;
+    uint32_t start;
+
+    if (level < RUN_LEVEL)
+        return 0;
+    dist = runDistance(s, offset) & 0xff;
+    if (!dist)
+        return 0;
+    start = s->window_start + offset + 2;
+    if (s->totalOut + offset + dist + 2 < s->decompSize && s->window[(start + dist) % WINDOW_SIZE] != s->window[start % WINDOW_SIZE])
+        hashPush(s, runHash(s, offset, dist, dist + 2), offset, level);
+    return 1;
+}
+
+FORCE_INLINE void hashWrite(Yaz0Stream* s, uint32_t h, uint32_t offset, int level)
+{
+    /* Already inserted by the look-ahead of literalGroupWins */
+    if (s->totalOut + offset < s->htNext)
+        return;
+    if (!runWrite(s, offset, level))
+        hashPush(s, h, offset, level);
+}
+
+/*
+ * Walk the buckets of h for a longer match, returns nonzero once there is
+ * no point going on. Entries are shift bytes past where the match starts.
+ */
+FORCE_INLINE int hashProbe(Yaz0Stream* s, uint32_t h, uint32_t offset, uint32_t shift, uint32_t* bestSize, uint32_t* bestPos, uint32_t* probes, int level, int farther)
+{
+    const HashBucket* bucket;
+    uint32_t mask;
+    uint32_t j;
     uint32_t size;
     uint32_t pos;
-    uint32_t maxProbes;
+    uint32_t maxBuckets;
+    uint32_t cur;
+    uint32_t hint;
+    uint32_t limit;
+    uint32_t age;
+    uint16_t tag;
+    uint16_t now;
 
-    bestSize = 0;
-    bestPos = 0;
-    maxProbes = kProbesPerLevel[s->level];
-    for (uint32_t i = 0; i < maxProbes; ++i)
+    maxBuckets = kBucketsPerLevel[level];
+    cur = s->totalOut + offset;
+    now = (uint16_t)cur;
+    limit = s->decompSize - cur;
+    if (limit > 0x111)
+        limit = 0x111;
+    tag = (uint16_t)(h >> 16);
+    for (uint32_t i = 0; i < maxBuckets; ++i)
     {
-        bucket = (h + i) % HASH_MAX_ENTRIES;
-        entry = s->htEntries[bucket];
-        if (entry == 0xffffffff)
-            break;
-        if (s->htHashes[bucket] == h)
+        bucket = s->ht + ((h + i) % HASH_BUCKETS);
+        mask = bucketTags(bucket, tag);
+        while (mask)
         {
-            pos = s->totalOut + offset - entry;
-            if (pos > 0x1000)
+            j = ctz(mask);
+            mask &= mask - 1;
+            age = entryAge(now, bucket->pos[j]);
+            if (age == 0 || age > 0x1000)
+                continue;
+            pos = age + shift;
+            if (pos > 0x1000 || pos > cur)
                 continue;
-            size = matchSize(s, offset, pos, bestSize);
-            if (size > bestSize)
+            /* Decoders copy non-overlapping matches faster */
+            hint = *bestSize;
+            if (farther && *bestPos < *bestSize && pos >= *bestSize)
+                hint--;
+            size = matchSize(s, offset, pos, hint);
+            if (size > *bestSize || (size == *bestSize && hint < *bestSize))
             {
-                bestSize = size;
-                bestPos = pos;
+                *bestSize = size;
+                *bestPos = pos;
             }
+            /* Nothing can beat the longest match, unless it overlaps */
+            if (*bestSize == limit && (!farther || *bestPos >= *bestSize))
+                return 1;
+            if (++*probes == kProbesPerLevel[level])
+                return 1;
         }
+        /* Anything that spilled over before the window is out of it too */
+        /* Spills a few bytes ahead come from the look-ahead and count as recent */
+        age = entryAge(now, s->htSpill[(h + i) % HASH_BUCKETS]);
+        if (age > 0x1000 && age < 0x10000 - 8)
+            break;
     }
+    return 0;
+}
+
+/* Match against the runs, returns nonzero once there is no point going on */
+FORCE_INLINE int runProbe(Yaz0Stream* s, uint32_t offset, uint32_t* bestSize, uint32_t* bestPos, uint32_t* probes, int level, int farther)
+{
+    uint32_t dists;
+    uint32_t dist;
+    uint32_t len;
+    uint32_t size;
+    uint32_t limit;
+
+    if (level < RUN_LEVEL)
+        return 0;
+    limit = s->decompSize - s->totalOut - offset;
+    if (limit > 0x111)
+        limit = 0x111;
+
+    /* Inside a run, the tables don't have it, but it goes on to its end */
+    dists = runDistance(s, offset);
+    dist = dists & 0xff;
+    if (dist)
+    {
+        size = runLength(s, offset, dist);
+        if (!size)
+            size = limit;
+        if (size > *bestSize)
+        {
+            *bestSize = size;
+            *bestPos = dist;
+        }
+        if (*bestSize == limit && (!farther || *bestPos >= *bestSize))
+            return 1;
+    }
+
+    /* Earlier runs that end the same way, and then go on matching */
+    dist = dists >> 8;
+    if (!dist)
+        return 0;
+    len = runLength(s, offset, dist);
+    if (!len)
+        return 0;
+    return hashProbe(s, runHash(s, offset, dist, len), offset, len - dist - 2, bestSize, bestPos, probes, level, farther);
+}
+
+FORCE_INLINE void findHashMatch(Yaz0Stream* s, uint32_t h, uint32_t offset, uint32_t* outSize, uint32_t* outPos, int level, int farther)
+{
+    uint32_t bestSize;
+    uint32_t bestPos;
+    uint32_t probes;
+
+    bestSize = 0;
+    bestPos = 0;
+    probes = 0;
+    if (!runProbe(s, offset, &bestSize, &bestPos, &probes, level, farther))
+        hashProbe(s, h, offset, 0, &bestSize, &bestPos, &probes, level, farther);
 
     if (bestSize < 3)
     {
         *outSize = 0;
+        *outPos = 0;
     }
     else
     {
@@ -240,6 +583,352 @@ static void findHashMatch(Yaz0Stream* s, uint32_t h, uint32_t offset, uint32_t*
     }
 }
 
+/*
+ * Binary tree match finder, used above level 9.
+ * Every position is inserted into a binary search tree of the suffixes
+ * sharing its hash, so walking down the tree visits the longest match
+ * in the whole window. Nodes are visited newest first, which means that
+ * on equal sizes the closest match wins. The walk stops when leaving
+ * the window, so the work per byte is bounded by its size.
+ */
+FORCE_INLINE uint32_t treeMatch(Yaz0Stream* s, uint32_t offset, uint32_t* outPos, int farther)
+{
+    uint32_t cur;
+    uint32_t limit;
+    uint32_t base;
+    uint32_t cursor;
+    uint32_t h;
+    uint32_t match;
+    uint32_t delta;
+    uint32_t len;
+    uint32_t len0;
+    uint32_t len1;
+    uint32_t bestSize;
+    uint32_t bestPos;
+    uint32_t* node;
+    uint32_t* ptr0;
+    uint32_t* ptr1;
+
+    cur = s->totalOut + offset;
+    limit = s->decompSize - cur;
+    if (limit < 3)
+        return 0;
+    if (limit > 0x111)
+        limit = 0x111;
+    base = (s->window_start + offset) % WINDOW_SIZE;
+    h = hash(s->window[base], s->window[(base + 1) % WINDOW_SIZE], s->window[(base + 2) % WINDOW_SIZE]) % BT_HASH_SIZE;
+    match = s->btHead[h];
+    s->btHead[h] = cur;
+
+    ptr1 = &s->btNodes[cur % BT_SIZE][0];
+    ptr0 = &s->btNodes[cur % BT_SIZE][1];
+    len0 = 0;
+    len1 = 0;
+    bestSize = 0;
+    bestPos = 0;
+    for (;;)
+    {
+        delta = cur - match;
+        if (match == BT_NIL || delta > 0x1000)
+        {
+            *ptr0 = BT_NIL;
+            *ptr1 = BT_NIL;
+            break;
+        }
+        len = len0 < len1 ? len0 : len1;
+        cursor = (base + WINDOW_SIZE - delta) % WINDOW_SIZE;
+        len = extendMatch(s->window, cursor, base, len, limit);
+        if (len > bestSize || (farther && len == bestSize && bestPos < len && delta >= len))
+        {
+            bestSize = len;
+            bestPos = delta;
+        }
+        node = s->btNodes[match % BT_SIZE];
+        if (len == limit)
+        {
+            /* Full match - the new node replaces the old one */
+            *ptr1 = node[0];
+            *ptr0 = node[1];
+            break;
+        }
+        if (s->window[(cursor + len) % WINDOW_SIZE] < s->window[(base + len) % WINDOW_SIZE])
+        {
+            *ptr1 = match;
+            ptr1 = &node[1];
+            match = *ptr1;
+            len1 = len;
+        }
+        else
+        {
+            *ptr0 = match;
+            ptr0 = &node[0];
+            match = *ptr0;
+            len0 = len;
+        }
+    }
+
+    if (bestSize < 3)
+        return 0;
+    *outPos = bestPos;
+    return bestSize;
+}
+
+FORCE_INLINE uint32_t treeFind(Yaz0Stream* s, uint32_t offset, uint32_t* outPos, int farther)
+{
+    uint32_t cur;
+    uint32_t size;
+    uint32_t pos;
+
+    /* Insert every position once and in order, keeping recent results */
+    cur = s->totalOut + offset;
+    while (s->btNext <= cur)
+    {
+        pos = 0;
+        size = treeMatch(s, s->btNext - s->totalOut, &pos, farther);
+        s->btCacheSize[s->btNext % BT_CACHE] = (uint16_t)size;
+        s->btCacheDist[s->btNext % BT_CACHE] = (uint16_t)pos;
+        s->btNext++;
+    }
+    *outPos = s->btCacheDist[cur % BT_CACHE];
+    return s->btCacheSize[cur % BT_CACHE];
+}
+
+FORCE_INLINE uint32_t findMatch(Yaz0Stream* s, uint32_t offset, uint32_t* outPos, int level, int farther)
+{
+    uint32_t start;
+    uint32_t h;
+    uint32_t size;
+
+    if (level > 9)
+        return treeFind(s, offset, outPos, farther);
+    start = s->window_start + offset;
+    h = hash(s->window[start % WINDOW_SIZE], s->window[(start + 1) % WINDOW_SIZE], s->window[(start + 2) % WINDOW_SIZE]);
+    findHashMatch(s, h, offset, &size, outPos, level, farther);
+    return size;
+}
+
+/*
+ * Recompression seeds the match finder with the distances of the stream
+ * being recompressed. Each position holds the distance of the reference
+ * that covered it, and its neighbours those of the tokens around it, which
+ * the new parse may well cut in different places. The source of a hint was
+ * itself often copied from further back, so the search follows those
+ * references too, like a hash chain the old encoder built. A hint that
+ * reaches the nice length of the level is taken on trust: the tables are
+ * neither searched for it nor filled with the positions it covers.
+ */
+#define HINT_CHAIN  32
+
+FORCE_INLINE void hintMatch(Yaz0Stream* s, uint32_t offset, uint32_t* outSize, uint32_t* outPos, int level)
+{
+    uint32_t cur;
+    uint32_t first;
+    uint32_t last;
+    uint32_t dist;
+    uint32_t size;
+    uint32_t next;
+    uint32_t limit;
+
+    cur = s->totalOut + offset;
+    if (cur >= s->decompSize)
+        return;
+    limit = cur < 0x1000 ? cur : 0x1000;
+    first = cur ? cur - 1 : cur;
+    last = cur + 1 < s->decompSize ? cur + 1 : cur;
+    for (uint32_t i = first; i <= last; ++i)
+    {
+        dist = s->hints[i];
+        if (i > first && dist == s->hints[i - 1])
+            continue;
+        for (int k = 0; k < HINT_CHAIN && dist && dist <= limit; ++k)
+        {
+            if (dist != *outPos)
+            {
+                size = matchSize(s, offset, dist, *outSize);
+                if (size > *outSize && size >= 3)
+                {
+                    *outSize = size;
+                    *outPos = dist;
+                    if (size >= kNicePerLevel[level])
+                        return;
+                }
+            }
+            /* Where the source came from, a literal ends the chain */
+            next = s->hints[cur - dist];
+            dist = next ? dist + next : 0;
+        }
+    }
+}
+
+/*
+ * Runs of a byte or of a short pattern hash every position to the same
+ * buckets, and each of them then compares in full against the others.
+ * Once a match of the longest size overlaps itself, the data is periodic,
+ * and the next match is tried at the same distance first. It is taken as
+ * is if it is just as long. The positions it covers are not inserted, so
+ * the tables do not fill up with copies of the run.
+ */
+FORCE_INLINE uint32_t runMatch(Yaz0Stream* s)
+{
+    uint32_t limit;
+
+    limit = s->decompSize - s->totalOut;
+    if (limit > 0x111)
+        limit = 0x111;
+    if (limit >= 3 && matchSize(s, 0, s->runDist, 0) == limit)
+        return limit;
+    s->runDist = 0;
+    return 0;
+}
+
+/*
+ * Decode cost model for YAZ0_STRATEGY_DECODE_SPEED, in nanoseconds as
+ * measured on the streaming decoder. A token in a mixed group mostly
+ * pays for a mispredicted branch, no matter its kind or size, while an
+ * all-literal group is copied in one go. Extra output is priced per
+ * byte against that. Copies overlapping their own output go byte by
+ * byte, so the match finders also prefer a farther match of equal size.
+ */
+#define COST_TOKEN              6
+#define COST_LITERAL_GROUP      6
+#define COST_SAVED_BYTE         16
+
+/*
+ * Insert the positions up to offset ahead of the main loop, so that the
+ * look-ahead sees the same table it would. The main loop skips them later.
+ */
+FORCE_INLINE void hashFill(Yaz0Stream* s, uint32_t offset, int level)
+{
+    uint32_t start;
+
+    if (s->htNext < s->totalOut)
+        s->htNext = s->totalOut;
+    while (s->htNext < s->totalOut + offset)
+    {
+        start = (s->window_start + s->htNext - s->totalOut) % WINDOW_SIZE;
+        hashWrite(s, hash(s->window[start], s->window[(start + 1) % WINDOW_SIZE], s->window[(start + 2) % WINDOW_SIZE]), s->htNext - s->totalOut, level);
+        s->htNext++;
+    }
+}
+
+/* Whether the next group decodes faster as 8 literals, for little size */
+FORCE_INLINE int literalGroupWins(Yaz0Stream* s, int level)
+{
+    uint32_t count;
+    uint32_t tokens;
+    uint32_t saved;
+    uint32_t size;
+    uint32_t pos;
+
+    count = s->decompSize - s->totalOut;
+    if (count > 8)
+        count = 8;
+    s->lookStart = s->totalOut;
+    s->lookMask = 0;
+    tokens = 0;
+    saved = 0;
+    for (uint32_t i = 0; i < count;)
+    {
+        /* Greedy parse - good enough to price the group */
+        tokens++;
+        if (level <= 9)
+            hashFill(s, i, level);
+        size = findMatch(s, i, &pos, level, 1);
+        s->lookMask |= (1u << i);
+        s->lookSize[i] = (uint16_t)size;
+        s->lookDist[i] = (uint16_t)pos;
+        if (size)
+        {
+            saved += size - (size >= 0x12 ? 3 : 2);
+            if (saved * COST_SAVED_BYTE >= 8 * COST_TOKEN)
+                return 0;
+            i += size;
+        }
+        else
+            i++;
+    }
+    return tokens * COST_TOKEN > COST_LITERAL_GROUP + saved * COST_SAVED_BYTE;
+}
+
+/* Reuse the look-ahead of literalGroupWins, it saw the table in the same state */
+FORCE_INLINE void lookupMatch(Yaz0Stream* s, uint32_t h, uint32_t offset, uint32_t* outSize, uint32_t* outPos, int level, int farther)
+{
+    uint32_t i;
+
+    i = s->totalOut + offset - s->lookStart;
+    if (farther && i < 8 && (s->lookMask & (1u << i)))
+    {
+        *outSize = s->lookSize[i];
+        *outPos = s->lookDist[i];
+        return;
+    }
+    findHashMatch(s, h, offset, outSize, outPos, level, farther);
+}
+
+/* Hints first, and the tables only if they come up short */
+FORCE_INLINE void hintedMatch(Yaz0Stream* s, uint32_t h, uint32_t offset, uint32_t* outSize, uint32_t* outPos, int level, int farther, int hinted)
+{
+    uint32_t size;
+    uint32_t pos;
+
+    size = 0;
+    pos = 0;
+    if (hinted)
+    {
+        hintMatch(s, offset, &size, &pos, level);
+        if (size >= kNicePerLevel[level])
+        {
+            *outSize = size;
+            *outPos = pos;
+            return;
+        }
+    }
+    lookupMatch(s, h, offset, outSize, outPos, level, farther);
+    if (size > *outSize)
+    {
+        *outSize = size;
+        *outPos = pos;
+    }
+}
+
+/* Yay0 splits the same tokens into mask, link and chunk streams */
+static void emitGroupYay0(Yaz0Stream* s, uint8_t header, int count, const uint32_t* arrSize, const uint32_t* arrPos)
+{
+    uint8_t* links;
+    uint8_t* chunks;
+    uint32_t size;
+    uint32_t pos;
+
+    /* Room was reserved before compressing the group */
+    s->masks.data[s->masks.size++] = header;
+    links = s->links.data + s->links.size;
+    chunks = s->chunks.data + s->chunks.size;
+    for (int i = 0; i < count; ++i)
+    {
+        size = arrSize[i];
+        pos = arrPos[i];
+        if (!size)
+            *chunks++ = (uint8_t)pos;
+        else
+        {
+            pos--;
+            if (size >= 0x12)
+            {
+                *links++ = (uint8_t)(pos >> 8);
+                *links++ = (uint8_t)pos;
+                *chunks++ = (uint8_t)(size - 0x12);
+            }
+            else
+            {
+                *links++ = (uint8_t)(pos >> 8) | (uint8_t)((size - 2) << 4);
+                *links++ = (uint8_t)pos;
+            }
+        }
+    }
+    s->links.size = (uint32_t)(links - s->links.data);
+    s->chunks.size = (uint32_t)(chunks - s->chunks.data);
+}
+
 static void emitGroup(Yaz0Stream* s, int count, const uint32_t* arrSize, const uint32_t* arrPos)
 {
     uint8_t header;
@@ -252,6 +941,11 @@ static void emitGroup(Yaz0Stream* s, int count, const uint32_t* arrSize, const u
         if (!arrSize[i])
             header |= (1 << (7 - i));
     }
+    if (s->format == FORMAT_YAY0)
+    {
+        emitGroupYay0(s, header, count, arrSize, arrPos);
+        return;
+    }
     s->out[s->cursorOut++] = header;
     for (int i = 0; i < count; ++i)
     {
@@ -279,7 +973,32 @@ static void emitGroup(Yaz0Stream* s, int count, const uint32_t* arrSize, const u
     }
 }
 
-static void compressGroup(Yaz0Stream* s)
+FORCE_INLINE void emitLiteralGroup(Yaz0Stream* s, int level)
+{
+    uint32_t arrSize[8];
+    uint32_t arrPos[8];
+    uint32_t start;
+    int groupCount;
+
+    for (groupCount = 0; groupCount < 8; ++groupCount)
+    {
+        start = s->window_start;
+        if (level <= 9)
+            hashWrite(s, hash(s->window[start], s->window[(start + 1) % WINDOW_SIZE], s->window[(start + 2) % WINDOW_SIZE]), 0, level);
+        arrSize[groupCount] = 0;
+        arrPos[groupCount] = s->window[start];
+        s->window_start = (start + 1) % WINDOW_SIZE;
+        s->totalOut += 1;
+        if (s->totalOut >= s->decompSize)
+        {
+            groupCount++;
+            break;
+        }
+    }
+    emitGroup(s, groupCount, arrSize, arrPos);
+}
+
+FORCE_INLINE void compressGroupHash(Yaz0Stream* s, int level, int farther, int hinted)
 {
     int groupCount;
     uint32_t h;
@@ -293,19 +1012,44 @@ static void compressGroup(Yaz0Stream* s)
     uint8_t b;
     uint8_t c;
     uint8_t d;
+    int trusted;
+
+    if (s->totalOut >= s->htSweep)
+        hashSweep(s);
+    if (farther && !s->runDist && literalGroupWins(s, level))
+    {
+        emitLiteralGroup(s, level);
+        return;
+    }
 
     for (groupCount = 0; groupCount < 8; ++groupCount)
     {
+        if (s->runDist && (size = runMatch(s)) != 0)
+        {
+            arrSize[groupCount] = size;
+            arrPos[groupCount] = s->runDist;
+            s->window_start = (s->window_start + size) % WINDOW_SIZE;
+            s->totalOut += size;
+            if (s->totalOut >= s->decompSize)
+            {
+                groupCount++;
+                break;
+            }
+            continue;
+        }
+
         a = s->window[s->window_start];
         b = s->window[(s->window_start + 1) % WINDOW_SIZE];
         c = s->window[(s->window_start + 2) % WINDOW_SIZE];
         d = s->window[(s->window_start + 3) % WINDOW_SIZE];
         h = hash(a, b, c);
-        findHashMatch(s, h, 0, &size, &pos);
-        hashWrite(s, h, 0);
+        hintedMatch(s, h, 0, &size, &pos, level, farther, hinted);
+        trusted = hinted && size >= kNicePerLevel[level];
+        if (!trusted)
+            hashWrite(s, h, 0, level);
 
         h = hash(b, c, d);
-        findHashMatch(s, h, 1, &nextSize, &nextPos);
+        hintedMatch(s, h, 1, &nextSize, &nextPos, level, farther, hinted);
 
         if (!size || nextSize > size)
         {
@@ -318,14 +1062,84 @@ static void compressGroup(Yaz0Stream* s)
         {
             arrSize[groupCount] = size;
             arrPos[groupCount] = pos;
-            for (uint32_t i = 1; i < size; ++i)
+            if (size == 0x111 && pos < size)
+                s->runDist = pos;
+            for (uint32_t i = 1; i < size && !trusted; ++i)
             {
                 a = b;
                 b = c;
                 c = s->window[(s->window_start + 2 + i) % WINDOW_SIZE];
                 h = hash(a, b, c);
-                hashWrite(s, h, i);
+                hashWrite(s, h, i, level);
+            }
+            s->window_start += size;
+            s->totalOut += size;
+        }
+        s->window_start %= WINDOW_SIZE;
+        if (s->totalOut >= s->decompSize)
+        {
+            groupCount++;
+            break;
+        }
+    }
+    emitGroup(s, groupCount, arrSize, arrPos);
+}
+
+FORCE_INLINE void compressGroupTree(Yaz0Stream* s, int farther)
+{
+    int groupCount;
+    uint32_t size;
+    uint32_t pos;
+    uint32_t nextSize;
+    uint32_t nextPos;
+    uint32_t arrSize[8];
+    uint32_t arrPos[8];
+
+    if (farther && !s->runDist && literalGroupWins(s, YAZ0_MAX_LEVEL))
+    {
+        size = s->decompSize - s->totalOut;
+        treeFind(s, (size < 8 ? size : 8) - 1, &pos, farther);
+        emitLiteralGroup(s, YAZ0_MAX_LEVEL);
+        return;
+    }
+
+    for (groupCount = 0; groupCount < 8; ++groupCount)
+    {
+        if (s->runDist && (size = runMatch(s)) != 0)
+        {
+            arrSize[groupCount] = size;
+            arrPos[groupCount] = s->runDist;
+            s->window_start = (s->window_start + size) % WINDOW_SIZE;
+            s->totalOut += size;
+            /* Positions of the run are left out of the tree */
+            if (s->btNext < s->totalOut)
+                s->btNext = s->totalOut;
+            if (s->totalOut >= s->decompSize)
+            {
+                groupCount++;
+                break;
             }
+            continue;
+        }
+
+        size = treeFind(s, 0, &pos, farther);
+        nextSize = treeFind(s, 1, &nextPos, farther);
+
+        if (!size || nextSize > size)
+        {
+            arrSize[groupCount] = 0;
+            arrPos[groupCount] = s->window[s->window_start];
+            s->window_start += 1;
+            s->totalOut += 1;
+        }
+        else
+        {
+            arrSize[groupCount] = size;
+            arrPos[groupCount] = pos;
+            if (size == 0x111 && pos < size)
+                s->runDist = pos;
+            /* Insert the positions covered by the match */
+            treeFind(s, size - 1, &nextPos, farther);
             s->window_start += size;
             s->totalOut += size;
         }
@@ -336,45 +1150,214 @@ static void compressGroup(Yaz0Stream* s)
             break;
         }
     }
-    if (s->htSize > HASH_REBUILD)
-        rebuildHashTable(s);
     emitGroup(s, groupCount, arrSize, arrPos);
 }
 
+/*
+ * The compressor core is instantiated once per level and strategy, so
+ * the probe and bucket counts are constants and unused paths go away.
+ * Only levels 1 to 9 have hash tables sized for them, the tree above
+ * that takes no level. Recompression hints only go to the hash match
+ * finder, the tree always finds the longest match already.
+ */
+#define HASH_KERNELS(level) \
+    static void compressGroup##level(Yaz0Stream* s) \
+    { \
+        compressGroupHash(s, level, 0, 0); \
+    } \
+    static void compressGroupFast##level(Yaz0Stream* s) \
+    { \
+        compressGroupHash(s, level, 1, 0); \
+    } \
+    static void compressGroupHint##level(Yaz0Stream* s) \
+    { \
+        compressGroupHash(s, level, 0, 1); \
+    }
+
+HASH_KERNELS(1)
+HASH_KERNELS(2)
+HASH_KERNELS(3)
+HASH_KERNELS(4)
+HASH_KERNELS(5)
+HASH_KERNELS(6)
+HASH_KERNELS(7)
+HASH_KERNELS(8)
+HASH_KERNELS(9)
+
+static void compressGroup10(Yaz0Stream* s)
+{
+    compressGroupTree(s, 0);
+}
+
+static void compressGroupFast10(Yaz0Stream* s)
+{
+    compressGroupTree(s, 1);
+}
+
+typedef void (*CompressFunc)(Yaz0Stream* s);
+
+static const CompressFunc kKernels[][3] = {
+    { NULL, NULL, NULL },
+    { compressGroup1, compressGroupFast1, compressGroupHint1 },
+    { compressGroup2, compressGroupFast2, compressGroupHint2 },
+    { compressGroup3, compressGroupFast3, compressGroupHint3 },
+    { compressGroup4, compressGroupFast4, compressGroupHint4 },
+    { compressGroup5, compressGroupFast5, compressGroupHint5 },
+    { compressGroup6, compressGroupFast6, compressGroupHint6 },
+    { compressGroup7, compressGroupFast7, compressGroupHint7 },
+    { compressGroup8, compressGroupFast8, compressGroupHint8 },
+    { compressGroup9, compressGroupFast9, compressGroupHint9 },
+    { compressGroup10, compressGroupFast10, compressGroup10 }
+};
+
+static void selectKernel(Yaz0Stream* s)
+{
+    if (s->hints)
+        s->compressGroup = kKernels[s->level][2];
+    else
+        s->compressGroup = kKernels[s->level][s->strategy == YAZ0_STRATEGY_DECODE_SPEED];
+}
+
 int yaz0ModeCompress(Yaz0Stream* s, uint32_t size, int level)
 {
+    yaz0_FreeBuffers(s);
     memset(s, 0, sizeof(*s));
     s->mode = MODE_COMPRESS;
     s->decompSize = size;
+    s->sizeUnknown = (size == YAZ0_SIZE_UNKNOWN);
     if (level < 1)
         level = 1;
-    else if (level > 9)
-        level = 9;
+    else if (level > YAZ0_MAX_LEVEL)
+        level = YAZ0_MAX_LEVEL;
     s->level = level;
-    for (int i = 0; i < HASH_MAX_ENTRIES; ++i)
+    s->strategy = YAZ0_STRATEGY_DEFAULT;
+    selectKernel(s);
+    if (level > 9)
+    {
+        for (int i = 0; i < BT_HASH_SIZE; ++i)
+            s->btHead[i] = BT_NIL;
+    }
+    else
     {
-        s->htHashes[i]  = 0xffffffff;
-        s->htEntries[i] = 0xffffffff;
+        /* Align the table on cache lines, and make every slot look stale */
+        s->ht = (HashBucket*)(((uintptr_t)s->htBuffer + 63) & ~(uintptr_t)63);
+        for (int i = 0; i < HASH_BUCKETS; ++i)
+        {
+            for (int j = 0; j < HASH_BUCKET_SLOTS; ++j)
+                s->ht[i].pos[j] = (uint16_t)(0x10000 - HASH_STALE);
+            s->htSpill[i] = (uint16_t)(0x10000 - HASH_STALE);
+        }
+        s->htSweep = HASH_SWEEP;
     }
     return YAZ0_OK;
 }
 
-int yaz0_RunCompress(Yaz0Stream* stream)
+int yay0ModeCompress(Yaz0Stream* s, uint32_t size, int level)
+{
+    int ret;
+
+    ret = yaz0ModeCompress(s, size, level);
+    s->format = FORMAT_YAY0;
+    return ret;
+}
+
+int yaz0Strategy(Yaz0Stream* s, int strategy)
+{
+    s->strategy = strategy;
+    if (s->mode == MODE_COMPRESS)
+        selectKernel(s);
+    return YAZ0_OK;
+}
+
+void yaz0_CompressHints(Yaz0Stream* s, const uint16_t* hints)
+{
+    s->hints = hints;
+    selectKernel(s);
+}
+
+static void writeHeader(const Yaz0Stream* stream, uint8_t* out)
 {
     uint32_t tmp;
+    uint32_t linkOffset;
+    uint32_t chunkOffset;
+
+    linkOffset = 0;
+    chunkOffset = 0;
+    if (stream->format == FORMAT_YAY0)
+    {
+        /* Masks are 32-bit words */
+        linkOffset = 16 + ((stream->masks.size + 3) & ~3u);
+        chunkOffset = linkOffset + stream->links.size;
+    }
+    memcpy(out, stream->format == FORMAT_YAY0 ? "Yay0" : "Yaz0", 4);
+    tmp = stream->sizeUnknown ? 0 : swap32(stream->decompSize);
+    memcpy(out + 4, &tmp, 4);
+    tmp = swap32(linkOffset);
+    memcpy(out + 8, &tmp, 4);
+    tmp = swap32(chunkOffset);
+    memcpy(out + 12, &tmp, 4);
+}
+
+/* Write the whole Yay0 file, now that the stream sizes are known */
+static int drainYay0(Yaz0Stream* stream)
+{
+    uint8_t header[16];
+    uint8_t pad[3];
+    const uint8_t* parts[4];
+    uint32_t sizes[4];
+    uint32_t offset;
+    uint32_t size;
+
+    memset(pad, 0, sizeof(pad));
+    if (yaz0_BufferAppend(&stream->masks, pad, (4 - stream->masks.size % 4) % 4))
+        return YAZ0_OUT_OF_MEMORY;
+    writeHeader(stream, header);
+    parts[0] = header;
+    sizes[0] = 16;
+    parts[1] = stream->masks.data;
+    sizes[1] = stream->masks.size;
+    parts[2] = stream->links.data;
+    sizes[2] = stream->links.size;
+    parts[3] = stream->chunks.data;
+    sizes[3] = stream->chunks.size;
+
+    offset = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        if (stream->drainCursor < offset + sizes[i])
+        {
+            size = offset + sizes[i] - stream->drainCursor;
+            if (size > stream->sizeOut - stream->cursorOut)
+                size = stream->sizeOut - stream->cursorOut;
+            memcpy(stream->out + stream->cursorOut, parts[i] + (stream->drainCursor - offset), size);
+            stream->cursorOut += size;
+            stream->drainCursor += size;
+            if (stream->drainCursor < offset + sizes[i])
+                return YAZ0_NEED_AVAIL_OUT;
+        }
+        offset += sizes[i];
+    }
+    return YAZ0_OK;
+}
+
+int yaz0Header(const Yaz0Stream* stream, void* out)
+{
+    if (stream->sizeUnknown)
+        return YAZ0_NEED_AVAIL_IN;
+    writeHeader(stream, out);
+    return YAZ0_OK;
+}
+
+int yaz0_RunCompress(Yaz0Stream* stream)
+{
     int ret;
 
-    /* Write headers */
-    if (!stream->headersDone)
+    /* Write headers - the size is a placeholder if still unknown */
+    if (!stream->headersDone && stream->format == FORMAT_YAZ0)
     {
         if (stream->sizeOut < 16)
             return YAZ0_NEED_AVAIL_OUT;
-        memcpy(stream->out, "Yaz0", 4);
-        tmp = swap32(stream->decompSize);
-        memcpy(stream->out + 4, &tmp, 4);
-        tmp = 0;
-        memcpy(stream->out + 8, &tmp, 4);
-        memcpy(stream->out + 12, &tmp, 4);
+        writeHeader(stream, stream->out);
         stream->cursorOut += 16;
         stream->headersDone = 1;
     }
@@ -384,10 +1367,17 @@ int yaz0_RunCompress(Yaz0Stream* stream)
     {
         /* Check EOF */
         if (stream->totalOut >= stream->decompSize)
-            return YAZ0_OK;
+            return (stream->format == FORMAT_YAY0) ? drainYay0(stream) : YAZ0_OK;
 
         /* Check output space */
-        if (stream->sizeOut - stream->cursorOut < 1 + 8 * 3)
+        if (stream->format == FORMAT_YAY0)
+        {
+            if (yaz0_BufferReserve(&stream->masks, 1)
+                || yaz0_BufferReserve(&stream->links, 8 * 2)
+                || yaz0_BufferReserve(&stream->chunks, 8))
+                return YAZ0_OUT_OF_MEMORY;
+        }
+        else if (stream->sizeOut - stream->cursorOut < 1 + 8 * 3)
             return YAZ0_NEED_AVAIL_OUT;
 
         /* Check that we have consumed enough input */
@@ -396,6 +1386,6 @@ int yaz0_RunCompress(Yaz0Stream* stream)
             return ret;
 
         /* Compress one chunk */
-        compressGroup(stream);
+        stream->compressGroup(stream);
     }
 }
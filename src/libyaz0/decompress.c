@@ -4,11 +4,25 @@
 
 int yaz0ModeDecompress(Yaz0Stream* s)
 {
+    yaz0_FreeBuffers(s);
     memset(s, 0, sizeof(*s));
     s->mode = MODE_DECOMPRESS;
     return YAZ0_OK;
 }
 
+int yay0ModeDecompress(Yaz0Stream* s)
+{
+    yaz0ModeDecompress(s);
+    s->format = FORMAT_YAY0;
+    return YAZ0_OK;
+}
+
+int yaz0Strict(Yaz0Stream* s, int strict)
+{
+    s->strict = strict;
+    return YAZ0_OK;
+}
+
 void loadAux(Yaz0Stream* stream, uint32_t size)
 {
     if (stream->sizeIn - stream->cursorIn < size)
@@ -24,6 +38,19 @@ int flush(Yaz0Stream* stream)
 
     if (stream->window_start == stream->window_end)
         return YAZ0_OK;
+    if (stream->sink)
+    {
+        /* Hand out the window directly - at most two spans */
+        if (stream->window_start > stream->window_end)
+        {
+            stream->sink(stream->sinkData, stream->window + stream->window_start, WINDOW_SIZE - stream->window_start);
+            stream->window_start = 0;
+        }
+        if (stream->window_start != stream->window_end)
+            stream->sink(stream->sinkData, stream->window + stream->window_start, stream->window_end - stream->window_start);
+        stream->window_start = stream->window_end;
+        return YAZ0_OK;
+    }
     if (stream->cursorOut >= stream->sizeOut)
         return YAZ0_NEED_AVAIL_OUT;
     outSize = stream->sizeOut - stream->cursorOut;
@@ -54,9 +81,16 @@ static int yaz0_ReadHeaders(Yaz0Stream* stream)
     loadAux(stream, 16 - stream->auxSize);
     if (stream->auxSize < 16)
         return YAZ0_NEED_AVAIL_IN;
-    if (memcmp(stream->auxBuf, "Yaz0", 4))
+    if (memcmp(stream->auxBuf, stream->format == FORMAT_YAY0 ? "Yay0" : "Yaz0", 4))
         return YAZ0_BAD_MAGIC;
     stream->decompSize = swap32(*(uint32_t*)&stream->auxBuf[4]);
+    if (stream->format == FORMAT_YAY0)
+    {
+        stream->linkOffset = read32(stream->auxBuf + 8);
+        stream->chunkOffset = read32(stream->auxBuf + 12);
+        if (stream->linkOffset < 16 || stream->chunkOffset < stream->linkOffset)
+            return YAZ0_BAD_MAGIC;
+    }
     stream->auxSize = 0;
     return YAZ0_OK;
 }
@@ -84,7 +118,46 @@ static int ensureWindowFree(Yaz0Stream* stream)
     return YAZ0_OK;
 }
 
-int yaz0_DoDecompress(Yaz0Stream* stream)
+static void windowCopy(Yaz0Stream* stream, uint32_t r, uint32_t n)
+{
+    uint32_t cursor;
+
+    cursor = (stream->window_end + WINDOW_SIZE - r) % WINDOW_SIZE;
+    if (likely(cursor + n <= WINDOW_SIZE && stream->window_end + n <= WINDOW_SIZE))
+    {
+        /* No wrap around - straight copy */
+        if (r >= n)
+            memcpy(stream->window + stream->window_end, stream->window + cursor, n);
+        else
+        {
+            for (uint32_t i = 0; i < n; ++i)
+                stream->window[stream->window_end + i] = stream->window[cursor + i];
+        }
+        stream->window_end = (stream->window_end + n) % WINDOW_SIZE;
+    }
+    else
+    {
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            stream->window[stream->window_end++] = stream->window[cursor++];
+            stream->window_end %= WINDOW_SIZE;
+            cursor %= WINDOW_SIZE;
+        }
+    }
+    stream->totalOut += n;
+}
+
+/*
+ * The decode loops are instantiated per level of checking, so trusted
+ * decoding pays nothing for strict mode. A reference can only reach before
+ * the start of the data in the first window, so strict mode checks that
+ * until then, and afterwards only that the last match does not overshoot.
+ */
+#define CHECK_NONE  0
+#define CHECK_END   1
+#define CHECK_ALL   2
+
+FORCE_INLINE int yaz0_DecodeGroups(Yaz0Stream* stream, int strict)
 {
     uint8_t     groupBit;
     uint8_t     byte;
@@ -96,6 +169,8 @@ int yaz0_DoDecompress(Yaz0Stream* stream)
         /* No group and no EOF - We need to read */
         if (stream->groupCount == 0)
         {
+            if (strict == CHECK_ALL && stream->totalOut >= 0x1000)
+                return YAZ0_OK;
             /* Before we read, we eant to ensure the window is large enough */
             /* This will avoid a lot of checks and let us write the whole group */
             ret = ensureWindowFree(stream);
@@ -105,6 +180,20 @@ int yaz0_DoDecompress(Yaz0Stream* stream)
                 return YAZ0_NEED_AVAIL_IN;
             stream->groupHeader = stream->in[stream->cursorIn++];
             stream->groupCount = 8;
+
+            /* All-literal group - copy it in one go */
+            if (stream->groupHeader == 0xff
+                && stream->sizeIn - stream->cursorIn >= 8
+                && WINDOW_SIZE - stream->window_end >= 8
+                && stream->decompSize - stream->totalOut > 8)
+            {
+                memcpy(stream->window + stream->window_end, stream->in + stream->cursorIn, 8);
+                stream->cursorIn += 8;
+                stream->window_end = (stream->window_end + 8) % WINDOW_SIZE;
+                stream->totalOut += 8;
+                stream->groupCount = 0;
+                continue;
+            }
         }
 
         /* We have a group! */
@@ -149,26 +238,147 @@ int yaz0_DoDecompress(Yaz0Stream* stream)
                 }
                 r = ((uint16_t)(((uint8_t)stream->auxBuf[0] & 0x0f) << 8) | ((uint8_t)stream->auxBuf[1]));
                 r++;
+                /* Before the start of the data */
+                if (strict == CHECK_ALL && unlikely(r > stream->totalOut))
+                    return YAZ0_BAD_DATA;
+                windowCopy(stream, r, n);
                 /* Reset the aux buffer */
-                uint32_t cursor = (stream->window_end + WINDOW_SIZE - r) % WINDOW_SIZE;
-                for (int i = 0; i < n; ++i)
-                {
-                    stream->window[stream->window_end++] = stream->window[cursor++];
-                    stream->window_end %= WINDOW_SIZE;
-                    cursor %= WINDOW_SIZE;
-                }
                 stream->auxSize = 0;
-                stream->totalOut += n;
             }
             stream->groupCount--;
-            /* Check for EOF */
+            /* Check for EOF, strict mode also for a match running past it */
             if (stream->totalOut >= stream->decompSize)
+                return (strict && stream->totalOut > stream->decompSize) ? YAZ0_BAD_DATA : YAZ0_OK;
+        }
+    }
+}
+
+/* Yay0 keeps masks and links ahead of the chunks, so buffer them first */
+static int yay0_LoadTables(Yaz0Stream* stream)
+{
+    uint32_t size;
+    int ret;
+
+    size = stream->linkOffset - 16 - stream->masks.size;
+    if (size > stream->sizeIn - stream->cursorIn)
+        size = stream->sizeIn - stream->cursorIn;
+    ret = yaz0_BufferAppend(&stream->masks, stream->in + stream->cursorIn, size);
+    if (ret)
+        return ret;
+    stream->cursorIn += size;
+
+    size = stream->chunkOffset - stream->linkOffset - stream->links.size;
+    if (size > stream->sizeIn - stream->cursorIn)
+        size = stream->sizeIn - stream->cursorIn;
+    ret = yaz0_BufferAppend(&stream->links, stream->in + stream->cursorIn, size);
+    if (ret)
+        return ret;
+    stream->cursorIn += size;
+
+    /* Either table can be empty, so check both */
+    if (stream->masks.size < stream->linkOffset - 16 || stream->links.size < stream->chunkOffset - stream->linkOffset)
+        return YAZ0_NEED_AVAIL_IN;
+    return YAZ0_OK;
+}
+
+FORCE_INLINE int yay0_DecodeGroups(Yaz0Stream* stream, int strict)
+{
+    int ret;
+    uint32_t link;
+    uint32_t n;
+
+    for (;;)
+    {
+        /* Same window handling as Yaz0, 8 tokens at a time */
+        if (stream->groupCount == 0)
+        {
+            if (strict == CHECK_ALL && stream->totalOut >= 0x1000)
                 return YAZ0_OK;
+            ret = ensureWindowFree(stream);
+            if (ret)
+                return ret;
+            stream->groupCount = 8;
+        }
+
+        while (stream->groupCount)
+        {
+            if (!stream->maskBits)
+            {
+                /* Running out of tables can only mean bad data, no more input will fix it */
+                if (stream->masks.size - stream->maskCursor < 4)
+                    return strict ? YAZ0_BAD_DATA : YAZ0_NEED_AVAIL_IN;
+                stream->maskWord = read32(stream->masks.data + stream->maskCursor);
+                stream->maskCursor += 4;
+                stream->maskBits = 32;
+            }
+            if (stream->maskWord & 0x80000000)
+            {
+                if (stream->cursorIn >= stream->sizeIn)
+                    return YAZ0_NEED_AVAIL_IN;
+                stream->window[stream->window_end++] = stream->in[stream->cursorIn++];
+                stream->window_end %= WINDOW_SIZE;
+                stream->totalOut++;
+            }
+            else
+            {
+                if (stream->links.size - stream->linkCursor < 2)
+                    return strict ? YAZ0_BAD_DATA : YAZ0_NEED_AVAIL_IN;
+                link = ((uint32_t)stream->links.data[stream->linkCursor] << 8) | stream->links.data[stream->linkCursor + 1];
+                n = link >> 12;
+                if (!n)
+                {
+                    /* The extra length byte lives in the chunks */
+                    if (stream->cursorIn >= stream->sizeIn)
+                        return YAZ0_NEED_AVAIL_IN;
+                    n = (uint32_t)stream->in[stream->cursorIn++] + 0x12;
+                }
+                else
+                    n += 2;
+                if (strict == CHECK_ALL && unlikely((link & 0xfff) + 1 > stream->totalOut))
+                    return YAZ0_BAD_DATA;
+                stream->linkCursor += 2;
+                windowCopy(stream, (link & 0xfff) + 1, n);
+            }
+            stream->maskWord <<= 1;
+            stream->maskBits--;
+            stream->groupCount--;
+            if (stream->totalOut >= stream->decompSize)
+                return (strict && stream->totalOut > stream->decompSize) ? YAZ0_BAD_DATA : YAZ0_OK;
         }
     }
 }
 
-int yaz0_RunDecompress(Yaz0Stream* stream)
+static int yaz0_DoDecompress(Yaz0Stream* stream)
+{
+    int ret;
+
+    if (!stream->strict)
+        return yaz0_DecodeGroups(stream, CHECK_NONE);
+    if (stream->totalOut < 0x1000)
+    {
+        ret = yaz0_DecodeGroups(stream, CHECK_ALL);
+        if (ret || stream->totalOut >= stream->decompSize)
+            return ret;
+    }
+    return yaz0_DecodeGroups(stream, CHECK_END);
+}
+
+static int yay0_DoDecompress(Yaz0Stream* stream)
+{
+    int ret;
+
+    if (!stream->strict)
+        return yay0_DecodeGroups(stream, CHECK_NONE);
+    if (stream->totalOut < 0x1000)
+    {
+        ret = yay0_DecodeGroups(stream, CHECK_ALL);
+        if (ret || stream->totalOut >= stream->decompSize)
+            return ret;
+    }
+    return yay0_DecodeGroups(stream, CHECK_END);
+}
+
+static int runDecompress(Yaz0Stream* stream)
 {
     int ret;
 
@@ -180,18 +390,48 @@ int yaz0_RunDecompress(Yaz0Stream* stream)
             return ret;
         stream->headersDone = 1;
     }
+    if (stream->format == FORMAT_YAY0)
+    {
+        ret = yay0_LoadTables(stream);
+        if (ret)
+            return ret;
+    }
 
     if (stream->totalOut < stream->decompSize)
     {
         /* We did not decompress everything */
-        ret = yaz0_DoDecompress(stream);
+        if (stream->format == FORMAT_YAY0)
+            ret = yay0_DoDecompress(stream);
+        else
+            ret = yaz0_DoDecompress(stream);
         if (ret)
             return ret;
     }
+    if (stream->strict)
+    {
+        /* Only padding may follow, in this input or any later one */
+        if (yaz0_CheckTrailing(stream->in, stream->cursorIn, stream->sizeIn))
+            return YAZ0_BAD_DATA;
+        stream->cursorIn = stream->sizeIn;
+    }
 
     /* We did decompress everything */
     flush(stream);
     if (stream->window_start != stream->window_end)
         return YAZ0_NEED_AVAIL_OUT;
+    /* In strict mode we are only done once the input has ended */
+    if (stream->strict && !stream->inputEnd)
+        return YAZ0_NEED_AVAIL_IN;
     return YAZ0_OK;
 }
+
+int yaz0_RunDecompress(Yaz0Stream* stream)
+{
+    int ret;
+
+    ret = runDecompress(stream);
+    /* A strict stream that wants more input after its end is truncated */
+    if (ret == YAZ0_NEED_AVAIL_IN && stream->strict && stream->inputEnd)
+        return YAZ0_BAD_DATA;
+    return ret;
+}
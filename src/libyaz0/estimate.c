@@ -0,0 +1,124 @@
+#include "libyaz0.h"
+
+typedef struct
+{
+    uint64_t    sizeIn;
+    uint64_t    sizeOut;
+    uint64_t    time;
+} EstimateTotals;
+
+/* Run until the stream needs input or is done, counting the output */
+static int runCounted(Yaz0Stream* s, uint8_t* buf, uint32_t bufSize, uint64_t* count)
+{
+    int ret;
+
+    for (;;)
+    {
+        ret = yaz0Run(s);
+        *count += yaz0OutputChunkSize(s);
+        yaz0Output(s, buf, bufSize);
+        if (ret != YAZ0_NEED_AVAIL_OUT)
+            return ret;
+    }
+}
+
+/*
+ * Compress a block, after a warm-up that only fills the window. The stream
+ * is sized for the rest of the data, so the compressor stops short of both
+ * ends of the block for its look-ahead, just like it would in the middle of
+ * the input, and only whole groups in between are counted.
+ */
+static int sample(Yaz0Stream* s, const uint8_t* data, uint32_t dataSize, uint32_t start, uint32_t size, int level, EstimateTotals* totals)
+{
+    uint8_t buf[0x1000];
+    uint64_t count;
+    uint64_t skipOut;
+    uint32_t skipIn;
+    uint32_t warmup;
+    uint64_t time;
+    int ret;
+
+    warmup = start < ESTIMATE_WARMUP ? start : ESTIMATE_WARMUP;
+    yaz0ModeCompress(s, dataSize - (start - warmup), level);
+    yaz0Output(s, buf, sizeof(buf));
+    count = 0;
+
+    yaz0Input(s, data + start - warmup, warmup);
+    ret = runCounted(s, buf, sizeof(buf), &count);
+    if (ret != YAZ0_NEED_AVAIL_IN)
+        return ret;
+    skipIn = s->totalOut;
+    skipOut = count;
+
+    time = yaz0_Now();
+    yaz0Input(s, data + start, size);
+    ret = runCounted(s, buf, sizeof(buf), &count);
+    if (ret != YAZ0_NEED_AVAIL_IN && ret != YAZ0_OK)
+        return ret;
+    totals->time += yaz0_Now() - time;
+    totals->sizeIn += s->totalOut - skipIn;
+    totals->sizeOut += count - skipOut;
+    return YAZ0_OK;
+}
+
+int yaz0Estimate(const void* data, uint32_t size, int level, Yaz0Estimate* estimate)
+{
+    Yaz0Stream* s;
+    EstimateTotals totals;
+    uint32_t stride;
+    uint32_t block;
+    uint64_t v;
+    int ret;
+
+    estimate->size = 16;
+    estimate->time = 0;
+    if (!size)
+        return YAZ0_OK;
+
+    /*
+     * A sixteenth of the data, in at least 64 blocks - the count of blocks
+     * matters more than their size. Blocks are kept large enough that the
+     * warm-up does not dominate, at the cost of fewer blocks.
+     */
+    stride = ESTIMATE_STRIDE;
+    block = ESTIMATE_BLOCK;
+    if (size / stride < ESTIMATE_SAMPLES)
+    {
+        stride = size / ESTIMATE_SAMPLES;
+        block = stride / 16;
+    }
+    if (block < ESTIMATE_WARMUP / 2)
+    {
+        block = ESTIMATE_WARMUP / 2;
+        stride = block * 16;
+    }
+
+    ret = yaz0Init(&s);
+    if (ret)
+        return ret;
+    memset(&totals, 0, sizeof(totals));
+    if (size / stride < 16)
+    {
+        /* Too small to sample, just compress it all */
+        ret = sample(s, data, size, 0, size, level, &totals);
+    }
+    else
+    {
+        for (uint32_t pos = 0; size - pos >= block && ret == YAZ0_OK; pos += stride)
+        {
+            ret = sample(s, data, size, pos, block, level, &totals);
+            if (size - pos < stride)
+                break;
+        }
+    }
+    yaz0Destroy(s);
+    if (ret)
+        return ret;
+
+    /* The header goes out with the warm-up, so it was never counted */
+    v = totals.sizeOut * size / totals.sizeIn + 16;
+    estimate->size = v > 0xffffffff ? 0xffffffff : (uint32_t)v;
+    v = totals.time * size / totals.sizeIn;
+    estimate->time = v > 0xffffffff ? 0xffffffff : (uint32_t)v;
+    return YAZ0_OK;
+}
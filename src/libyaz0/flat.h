@@ -0,0 +1,234 @@
+#ifndef FLAT_H
+#define FLAT_H
+
+#include "libyaz0.h"
+
+/*
+ * Decoders for a whole stream held in memory, shared by the batch,
+ * parallel and recompression paths. They differ only in what they do
+ * with each token, so the callers pass that in as hooks, which inline
+ * away as the functions below are always inlined.
+ */
+typedef struct FlatDecoder FlatDecoder;
+
+/* n literals were just written at dst */
+typedef void (*FlatLiteralFunc)(FlatDecoder* dec, uint32_t dst, uint32_t n);
+/* A match of n bytes at distance r is to be written at dst */
+typedef void (*FlatMatchFunc)(FlatDecoder* dec, uint32_t dst, uint32_t r, uint32_t n);
+
+struct FlatDecoder
+{
+    const uint8_t*  in;
+    uint8_t*        out;
+    uint32_t        sizeIn;
+    uint32_t        decompSize;
+    uint32_t        cursorIn;
+    uint32_t        cursorOut;
+    int             strict;
+    int             yay0;
+    uint32_t        maskEnd;
+    uint32_t        linkCursor;
+    uint32_t        linkEnd;
+    uint32_t        chunkCursor;
+    int             result;
+};
+
+static __inline void flatNoLiterals(FlatDecoder* dec, uint32_t dst, uint32_t n)
+{
+    (void)dec;
+    (void)dst;
+    (void)n;
+}
+
+static __inline void flatCopyMatch(FlatDecoder* dec, uint32_t dst, uint32_t r, uint32_t n)
+{
+    copyMatch(dec->out, dst, r, n);
+}
+
+/* Set up a decoder for the whole stream, the header was already checked */
+static __inline void flatInit(FlatDecoder* dec, const uint8_t* in, uint32_t sizeIn, uint8_t* out, uint32_t decompSize, int strict)
+{
+    dec->in = in;
+    dec->out = out;
+    dec->sizeIn = sizeIn;
+    dec->decompSize = decompSize;
+    dec->cursorIn = 16;
+    dec->cursorOut = 0;
+    dec->strict = strict;
+    dec->yay0 = !memcmp(in, "Yay0", 4);
+    dec->maskEnd = dec->yay0 ? read32(in + 8) : 0;
+    dec->linkCursor = dec->maskEnd;
+    dec->linkEnd = dec->yay0 ? read32(in + 12) : 0;
+    dec->chunkCursor = dec->linkEnd;
+    dec->result = YAZ0_OK;
+}
+
+/* Decode a single group, returns nonzero once the stream is done or broken */
+FORCE_INLINE int flatDecodeGroup(FlatDecoder* dec, FlatLiteralFunc literals, FlatMatchFunc match)
+{
+    const uint8_t* in;
+    uint8_t* out;
+    uint32_t cursorIn;
+    uint32_t cursorOut;
+    uint32_t n;
+    uint32_t r;
+    uint8_t header;
+
+    in = dec->in;
+    out = dec->out;
+    cursorIn = dec->cursorIn;
+    cursorOut = dec->cursorOut;
+
+    if (cursorIn >= dec->sizeIn)
+        goto truncated;
+    header = in[cursorIn++];
+
+    /* All-literal group - copy it in one go */
+    if (header == 0xff && dec->sizeIn - cursorIn >= 8 && dec->decompSize - cursorOut > 8)
+    {
+        memcpy(out + cursorOut, in + cursorIn, 8);
+        literals(dec, cursorOut, 8);
+        dec->cursorIn = cursorIn + 8;
+        dec->cursorOut = cursorOut + 8;
+        return 0;
+    }
+
+    for (int i = 0; i < 8; ++i)
+    {
+        if (header & (0x80 >> i))
+        {
+            if (cursorIn >= dec->sizeIn)
+                goto truncated;
+            out[cursorOut] = in[cursorIn++];
+            literals(dec, cursorOut, 1);
+            cursorOut++;
+        }
+        else
+        {
+            if (dec->sizeIn - cursorIn < 2)
+                goto truncated;
+            n = in[cursorIn] >> 4;
+            r = ((((uint32_t)in[cursorIn] & 0x0f) << 8) | in[cursorIn + 1]) + 1;
+            cursorIn += 2;
+            if (!n)
+            {
+                if (cursorIn >= dec->sizeIn)
+                    goto truncated;
+                n = (uint32_t)in[cursorIn++] + 0x12;
+            }
+            else
+                n += 2;
+            if (n > dec->decompSize - cursorOut)
+            {
+                if (dec->strict)
+                    goto bad;
+                n = dec->decompSize - cursorOut;
+            }
+            if (unlikely(r > cursorOut) && dec->strict)
+                goto bad;
+            match(dec, cursorOut, r, n);
+            cursorOut += n;
+        }
+        if (cursorOut >= dec->decompSize)
+            break;
+    }
+    dec->cursorIn = cursorIn;
+    dec->cursorOut = cursorOut;
+    return cursorOut >= dec->decompSize;
+
+truncated:
+    /* The whole stream is there, so strict mode calls this bad data too */
+    dec->result = dec->strict ? YAZ0_BAD_DATA : YAZ0_NEED_AVAIL_IN;
+    return 1;
+
+bad:
+    dec->result = YAZ0_BAD_DATA;
+    return 1;
+}
+
+/* Decode the 32 tokens of a Yay0 mask word, returns nonzero once the stream is done or broken */
+FORCE_INLINE int flatDecodeWordYay0(FlatDecoder* dec, FlatLiteralFunc literals, FlatMatchFunc match)
+{
+    const uint8_t* in;
+    uint8_t* out;
+    uint32_t linkCursor;
+    uint32_t chunkCursor;
+    uint32_t cursorOut;
+    uint32_t mask;
+    uint32_t link;
+    uint32_t n;
+
+    in = dec->in;
+    out = dec->out;
+    linkCursor = dec->linkCursor;
+    chunkCursor = dec->chunkCursor;
+    cursorOut = dec->cursorOut;
+
+    if (dec->maskEnd - dec->cursorIn < 4)
+        goto tables;
+    mask = read32(in + dec->cursorIn);
+    dec->cursorIn += 4;
+    for (int i = 0; i < 32; ++i, mask <<= 1)
+    {
+        if (mask & 0x80000000)
+        {
+            if (chunkCursor >= dec->sizeIn)
+                goto truncated;
+            out[cursorOut] = in[chunkCursor++];
+            literals(dec, cursorOut, 1);
+            cursorOut++;
+        }
+        else
+        {
+            if (dec->linkEnd - linkCursor < 2)
+                goto tables;
+            link = ((uint32_t)in[linkCursor] << 8) | in[linkCursor + 1];
+            linkCursor += 2;
+            n = link >> 12;
+            if (!n)
+            {
+                if (chunkCursor >= dec->sizeIn)
+                    goto truncated;
+                n = (uint32_t)in[chunkCursor++] + 0x12;
+            }
+            else
+                n += 2;
+            if (n > dec->decompSize - cursorOut)
+            {
+                if (dec->strict)
+                    goto bad;
+                n = dec->decompSize - cursorOut;
+            }
+            if (unlikely((link & 0xfff) + 1 > cursorOut) && dec->strict)
+                goto bad;
+            match(dec, cursorOut, (link & 0xfff) + 1, n);
+            cursorOut += n;
+        }
+        if (cursorOut >= dec->decompSize)
+            break;
+    }
+    dec->linkCursor = linkCursor;
+    dec->chunkCursor = chunkCursor;
+    dec->cursorOut = cursorOut;
+    return cursorOut >= dec->decompSize;
+
+tables:
+    /* The tables are all there, so running out of them is bad data */
+    if (dec->strict)
+        goto bad;
+truncated:
+    dec->result = dec->strict ? YAZ0_BAD_DATA : YAZ0_NEED_AVAIL_IN;
+    return 1;
+
+bad:
+    dec->result = YAZ0_BAD_DATA;
+    return 1;
+}
+
+/* Where the data of a finished stream ends, for the strict trailing check */
+static __inline uint32_t flatEnd(const FlatDecoder* dec)
+{
+    return dec->yay0 ? dec->chunkCursor : dec->cursorIn;
+}
+
+#endif /* FLAT_H */
@@ -11,12 +11,16 @@ int yaz0Init(Yaz0Stream** ptr)
     s->mode = MODE_NONE;
     s->cursorOut = 0;
     s->decompSize = 0;
+    memset(&s->masks, 0, sizeof(s->masks));
+    memset(&s->links, 0, sizeof(s->links));
+    memset(&s->chunks, 0, sizeof(s->chunks));
     *ptr = s;
     return YAZ0_OK;
 }
 
 int yaz0Destroy(Yaz0Stream* stream)
 {
+    yaz0_FreeBuffers(stream);
     free(stream);
     return YAZ0_OK;
 }
@@ -45,11 +49,37 @@ int yaz0Input(Yaz0Stream* stream, const void* data, uint32_t size)
     return YAZ0_OK;
 }
 
+int yaz0InputEnd(Yaz0Stream* stream)
+{
+    /* Whatever is left of the current input is the last of it */
+    stream->inputEnd = 1;
+    if (stream->sizeUnknown)
+    {
+        stream->decompSize = stream->totalIn + (stream->sizeIn - stream->cursorIn);
+        stream->sizeUnknown = 0;
+    }
+    return YAZ0_OK;
+}
+
 int yaz0Output(Yaz0Stream* stream, void* data, uint32_t size)
 {
     stream->out = data;
     stream->sizeOut = size;
     stream->cursorOut = 0;
+    stream->sink = NULL;
+    return YAZ0_OK;
+}
+
+int yaz0OutputSink(Yaz0Stream* stream, Yaz0SinkFunc func, void* userdata)
+{
+    /* The compressor writes to its output in place, it has no use for a sink */
+    if (stream->mode != MODE_DECOMPRESS)
+        return YAZ0_BAD_MODE;
+    stream->out = NULL;
+    stream->sizeOut = 0;
+    stream->cursorOut = 0;
+    stream->sink = func;
+    stream->sinkData = userdata;
     return YAZ0_OK;
 }
 
@@ -1,10 +1,22 @@
 #ifndef LIBYAZ0_H
 #define LIBYAZ0_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <yaz0.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define YAZ0_SSE2 1
+#endif
+
+#if defined(_MSC_VER)
+# include <intrin.h>
+#endif
+
 #if defined(__GNUC__)
+# define ctz(x)          ((uint32_t)__builtin_ctz(x))
 # define likely(x)       (__builtin_expect((x),1))
 # define unlikely(x)     (__builtin_expect((x),0))
 # define unreachable()   __builtin_unreachable()
@@ -14,23 +26,86 @@
 # define unreachable()  do {} while (0)
 #endif
 
+#if defined(__GNUC__)
+# define FORCE_INLINE    static __inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+# define FORCE_INLINE    static __forceinline
+#else
+# define FORCE_INLINE    static __inline
+#endif
+
+#if !defined(__GNUC__)
+static __inline uint32_t ctz(uint32_t x)
+{
+# if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return (uint32_t)i;
+# else
+    uint32_t i;
+    for (i = 0; !(x & 1); ++i)
+        x >>= 1;
+    return i;
+# endif
+}
+#endif
+
 #define MODE_NONE               0
 #define MODE_DECOMPRESS         1
 #define MODE_COMPRESS           2
 
+#define FORMAT_YAZ0             0
+#define FORMAT_YAY0             1
+
 #define WINDOW_SIZE             0x4000
-#define HASH_MAX_ENTRIES        0x8000
-#define HASH_REBUILD            0x3000
+#define HASH_BUCKETS            0x800
+#define HASH_BUCKET_SLOTS       16
+#define HASH_SWEEP              0x4000
+#define HASH_STALE              0x8000
+#define BT_SIZE                 0x2000
+#define BT_HASH_SIZE            0x4000
+#define BT_NIL                  0xffffffff
+#define BT_CACHE                16
+#define MAX_THREADS             64
+#define SEGMENT_MIN_SIZE        0x10000
+#define DIRTY_WORDS             (0x2000 / 64)
+#define ESTIMATE_STRIDE         0x100000
+#define ESTIMATE_BLOCK          0x10000
+#define ESTIMATE_SAMPLES        64
+#define ESTIMATE_WARMUP         0x2000
+
+/* One cache line: 16-bit hash tags, then 16-bit positions */
+typedef struct
+{
+    uint16_t    tags[HASH_BUCKET_SLOTS];
+    uint16_t    pos[HASH_BUCKET_SLOTS];
+} HashBucket;
+
+typedef struct
+{
+    uint8_t*    data;
+    uint32_t    size;
+    uint32_t    capacity;
+} Yaz0Buffer;
 
 struct Yaz0Stream
 {
     int             mode;
+    int             format;
     int             headersDone;
     int             level;
+    int             strategy;
+    int             strict;
+    void            (*compressGroup)(Yaz0Stream* s);
+    int             sizeUnknown;
+    int             inputEnd;
     uint32_t        decompSize;
+    uint32_t        totalIn;
     uint32_t        totalOut;
     const uint8_t*  in;
     uint8_t*        out;
+    Yaz0SinkFunc    sink;
+    void*           sinkData;
     uint32_t        sizeIn;
     uint32_t        sizeOut;
     uint32_t        cursorIn;
@@ -42,14 +117,92 @@ struct Yaz0Stream
     uint32_t        window_start;
     uint32_t        window_end;
     uint8_t         window[WINDOW_SIZE];
-    uint32_t        htSize;
-    uint32_t        htHashes[HASH_MAX_ENTRIES];
-    uint32_t        htEntries[HASH_MAX_ENTRIES];
+    HashBucket*     ht;
+    uint32_t        htSweep;
+    uint32_t        htNext;
+    uint32_t        lookStart;
+    uint32_t        lookMask;
+    uint16_t        lookSize[8];
+    uint16_t        lookDist[8];
+    uint16_t        htSpill[HASH_BUCKETS];
+    uint8_t         htBuffer[sizeof(HashBucket) * HASH_BUCKETS + 63];
+    uint32_t        btNext;
+    uint16_t        btCacheSize[BT_CACHE];
+    uint16_t        btCacheDist[BT_CACHE];
+    uint32_t        btHead[BT_HASH_SIZE];
+    uint32_t        btNodes[BT_SIZE][2];
+    uint32_t        runDist;
+    uint32_t        runStep;
+    uint32_t        runFrom;
+    uint32_t        runEnd;
+    uint32_t        runAt[2];
+    uint16_t        runDists[2];
+    const uint16_t* hints;
+    uint32_t        linkOffset;
+    uint32_t        chunkOffset;
+    uint32_t        maskWord;
+    uint32_t        maskBits;
+    uint32_t        maskCursor;
+    uint32_t        linkCursor;
+    uint32_t        drainCursor;
+    Yaz0Buffer      masks;
+    Yaz0Buffer      links;
+    Yaz0Buffer      chunks;
 };
 
+typedef void (*Yaz0TaskFunc)(void* arg);
+
 int yaz0_RunDecompress(Yaz0Stream* stream);
 int yaz0_RunCompress(Yaz0Stream* stream);
+void yaz0_CompressHints(Yaz0Stream* stream, const uint16_t* hints);
+
+void yaz0_RunTasks(Yaz0TaskFunc func, void* args, size_t argSize, uint32_t count);
+uint64_t yaz0_Now(void);
+int  yaz0_StartJob(Yaz0BatchJob* job);
+int  yaz0_CheckTrailing(const uint8_t* in, uint32_t cursor, uint32_t size);
 
 uint32_t swap32(uint32_t v);
 
+int  yaz0_BufferReserve(Yaz0Buffer* b, uint32_t size);
+int  yaz0_BufferAppend(Yaz0Buffer* b, const void* data, uint32_t size);
+void yaz0_FreeBuffers(Yaz0Stream* s);
+
+static __inline uint32_t read32(const uint8_t* p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return swap32(v);
+}
+
+/* Copy a match within a flat buffer, the way the streaming window does */
+static __inline void copyMatch(uint8_t* out, uint32_t dst, uint32_t r, uint32_t n)
+{
+    if (unlikely(r > dst))
+    {
+        /* Before the start of the data - reads as zeroes, like the streaming window */
+        for (uint32_t j = 0; j < n; ++j, ++dst)
+            out[dst] = (dst >= r) ? out[dst - r] : 0;
+    }
+    else if (r >= n)
+        memcpy(out + dst, out + dst - r, n);
+    else if (n >= 16)
+    {
+        /* Overlapping - the pattern doubles with every copy */
+        while (n > r)
+        {
+            memcpy(out + dst, out + dst - r, r);
+            dst += r;
+            n -= r;
+            r *= 2;
+        }
+        memcpy(out + dst, out + dst - r, n);
+    }
+    else
+    {
+        for (uint32_t j = 0; j < n; ++j, ++dst)
+            out[dst] = out[dst - r];
+    }
+}
+
 #endif /* LIBYAZ0_H */
@@ -0,0 +1,380 @@
+#include <stdlib.h>
+#include <string.h>
+#include "flat.h"
+
+/* A back-reference left for the fix-up pass */
+typedef struct
+{
+    uint32_t    dst;
+    uint16_t    dist;
+    uint16_t    size;
+} Fixup;
+
+/* The decoder comes first, so the hooks can get back to their segment */
+typedef struct
+{
+    FlatDecoder     flat;
+    uint32_t        start;
+    uint32_t        end;
+    uint32_t        dirtyEnd;
+    int             defer;
+    Fixup*          fixups;
+    uint32_t        fixupCount;
+    uint32_t        fixupMax;
+    uint64_t        dirty[DIRTY_WORDS];
+} Segment;
+
+/*
+ * Bytes that depend on data before the segment are not known until the
+ * fix-up pass. They are tracked per byte in a ring of bits, large enough
+ * to cover the window and the longest match. A copy passes the bits of
+ * its source on to its destination, so this taint fades away as soon as
+ * literals replace the data in the window.
+ */
+static uint64_t dirtyGet(const Segment* seg, uint32_t pos, uint32_t len)
+{
+    uint32_t w;
+    uint32_t bit;
+    uint64_t v;
+
+    w = (pos / 64) % DIRTY_WORDS;
+    bit = pos % 64;
+    v = seg->dirty[w] >> bit;
+    if (bit + len > 64)
+        v |= seg->dirty[(w + 1) % DIRTY_WORDS] << (64 - bit);
+    if (len < 64)
+        v &= ((uint64_t)1 << len) - 1;
+    return v;
+}
+
+static void dirtySet(Segment* seg, uint32_t pos, uint32_t len, uint64_t v)
+{
+    uint32_t w;
+    uint32_t bit;
+    uint64_t mask;
+
+    w = (pos / 64) % DIRTY_WORDS;
+    bit = pos % 64;
+    mask = (len < 64) ? ((uint64_t)1 << len) - 1 : ~(uint64_t)0;
+    seg->dirty[w] = (seg->dirty[w] & ~(mask << bit)) | (v << bit);
+    if (bit + len > 64)
+    {
+        w = (w + 1) % DIRTY_WORDS;
+        seg->dirty[w] = (seg->dirty[w] & ~(mask >> (64 - bit))) | (v >> (64 - bit));
+    }
+}
+
+static void dirtyFill(Segment* seg, uint32_t pos, uint32_t n, uint64_t v)
+{
+    uint32_t len;
+
+    while (n)
+    {
+        len = n < 64 ? n : 64;
+        dirtySet(seg, pos, len, v);
+        pos += len;
+        n -= len;
+    }
+}
+
+/* Carry the bits over a copy, returns whether any byte is dirty */
+static int dirtyCopy(Segment* seg, uint32_t dst, uint32_t r, uint32_t n)
+{
+    uint64_t any;
+    uint64_t v;
+    uint32_t len;
+
+    if (r < n)
+    {
+        /* Overlapping - a single dirty byte in the pattern spreads all over it */
+        any = 0;
+        for (uint32_t i = 0; i < r; i += len)
+        {
+            len = r - i < 64 ? r - i : 64;
+            any |= dirtyGet(seg, dst - r + i, len);
+        }
+        dirtyFill(seg, dst, n, any ? ~(uint64_t)0 : 0);
+        return any != 0;
+    }
+    any = 0;
+    while (n)
+    {
+        len = n < 64 ? n : 64;
+        v = dirtyGet(seg, dst - r, len);
+        dirtySet(seg, dst, len, v);
+        any |= v;
+        dst += len;
+        n -= len;
+    }
+    return any != 0;
+}
+
+static int growFixups(Segment* seg)
+{
+    Fixup* fixups;
+    uint32_t max;
+
+    /* Past this, decoding the rest in order is cheaper than the bookkeeping */
+    max = seg->fixupMax ? seg->fixupMax * 2 : 0x400;
+    if (max > (seg->end - seg->start) / 16)
+        return 0;
+    fixups = realloc(seg->fixups, max * sizeof(*fixups));
+    if (!fixups)
+        return 0;
+    seg->fixups = fixups;
+    seg->fixupMax = max;
+    return 1;
+}
+
+static void deferMatch(Segment* seg, uint32_t dst, uint32_t r, uint32_t n)
+{
+    Fixup* f;
+
+    seg->dirtyEnd = dst + n;
+    f = seg->fixups + seg->fixupCount++;
+    f->dst = dst;
+    f->dist = (uint16_t)r;
+    f->size = (uint16_t)n;
+}
+
+static __inline void segmentLiterals(FlatDecoder* dec, uint32_t dst, uint32_t n)
+{
+    Segment* seg;
+
+    seg = (Segment*)dec;
+    if (seg->dirtyEnd)
+        dirtySet(seg, dst, n, 0);
+}
+
+static __inline void segmentMatch(FlatDecoder* dec, uint32_t dst, uint32_t r, uint32_t n)
+{
+    Segment* seg;
+
+    seg = (Segment*)dec;
+    if (likely(!seg->dirtyEnd))
+    {
+        copyMatch(dec->out, dst, r, n);
+        return;
+    }
+
+    /* The segment before may still be writing there, so don't even read it */
+    if (r > dst - seg->start)
+    {
+        dirtyFill(seg, dst, n, ~(uint64_t)0);
+        deferMatch(seg, dst, r, n);
+        return;
+    }
+
+    /* Dirty bytes are copied anyway, and copied again by the fix-up pass */
+    copyMatch(dec->out, dst, r, n);
+    if (dirtyCopy(seg, dst, r, n))
+        deferMatch(seg, dst, r, n);
+}
+
+static void decodeSegment(void* arg)
+{
+    Segment* seg;
+    FlatDecoder* dec;
+    uint32_t tokens;
+
+    seg = arg;
+    dec = &seg->flat;
+    tokens = dec->yay0 ? 32 : 8;
+    while (dec->cursorOut < seg->end)
+    {
+        /* Out of room - the fix-up pass will decode the rest in order */
+        if (seg->defer && seg->fixupMax - seg->fixupCount < tokens && !growFixups(seg))
+            return;
+        /* Nothing dirty is in reach anymore, and nothing can become dirty again */
+        if (seg->dirtyEnd && dec->cursorOut - seg->dirtyEnd > 0x1000)
+            seg->dirtyEnd = 0;
+        if (dec->yay0 ? flatDecodeWordYay0(dec, segmentLiterals, segmentMatch) : flatDecodeGroup(dec, segmentLiterals, segmentMatch))
+            return;
+    }
+}
+
+/* Walk the token lengths only, to find where each segment starts */
+static uint32_t scanSegments(Segment* segs, uint32_t count, const uint8_t* in, uint32_t sizeIn, uint32_t decompSize)
+{
+    uint32_t cursorIn;
+    uint32_t cursorOut;
+    uint32_t target;
+    uint32_t t;
+    uint32_t refs;
+    uint32_t extra;
+    uint32_t pos;
+    uint32_t nib;
+
+    cursorIn = 16;
+    cursorOut = 0;
+    t = 1;
+    target = (uint32_t)((uint64_t)decompSize * t / count);
+    while (t < count)
+    {
+        if (cursorOut >= target)
+        {
+            segs[t].flat.cursorIn = cursorIn;
+            segs[t].start = cursorOut;
+            t++;
+            target = (uint32_t)((uint64_t)decompSize * t / count);
+            continue;
+        }
+
+        /* A group is at most 25 bytes - short or truncated tails go to the last segment */
+        if (sizeIn - cursorIn < 25 || cursorOut >= decompSize)
+            break;
+
+        /* Count the group as 8 literals, then visit the references in order */
+        refs = (uint8_t)~in[cursorIn++];
+        refs = (uint32_t)(((refs * 0x0202020202ull) & 0x010884422010ull) % 1023);
+        extra = 0;
+        while (refs)
+        {
+            pos = cursorIn + ctz(refs) + extra;
+            refs &= refs - 1;
+            nib = in[pos] >> 4;
+            cursorOut += (nib ? nib + 2 : (uint32_t)in[pos + 2] + 0x12) - 1;
+            extra += nib ? 1 : 2;
+        }
+        cursorIn += 8 + extra;
+        cursorOut += 8;
+    }
+    return t;
+}
+
+/* Same as above, but the segments start on mask words and carry three cursors */
+static uint32_t scanSegmentsYay0(Segment* segs, uint32_t count, const uint8_t* in, uint32_t sizeIn, uint32_t decompSize)
+{
+    uint32_t maskEnd;
+    uint32_t linkEnd;
+    uint32_t cursorIn;
+    uint32_t linkCursor;
+    uint32_t chunkCursor;
+    uint32_t cursorOut;
+    uint32_t target;
+    uint32_t t;
+    uint32_t refs;
+    uint32_t bit;
+    uint32_t k;
+    uint32_t extra;
+    uint32_t nib;
+
+    maskEnd = read32(in + 8);
+    linkEnd = read32(in + 12);
+    cursorIn = 16;
+    linkCursor = maskEnd;
+    chunkCursor = linkEnd;
+    cursorOut = 0;
+    t = 1;
+    target = (uint32_t)((uint64_t)decompSize * t / count);
+    while (t < count)
+    {
+        if (cursorOut >= target)
+        {
+            segs[t].flat.cursorIn = cursorIn;
+            segs[t].flat.linkCursor = linkCursor;
+            segs[t].flat.chunkCursor = chunkCursor;
+            segs[t].start = cursorOut;
+            t++;
+            target = (uint32_t)((uint64_t)decompSize * t / count);
+            continue;
+        }
+
+        /* A mask word covers at most 32 links and 32 chunk bytes */
+        if (maskEnd - cursorIn < 4 || linkEnd - linkCursor < 64 || sizeIn - chunkCursor < 32 || cursorOut >= decompSize)
+            break;
+
+        for (uint32_t b = 0; b < 4; ++b)
+        {
+            refs = (uint8_t)~in[cursorIn++];
+            refs = (uint32_t)(((refs * 0x0202020202ull) & 0x010884422010ull) % 1023);
+            k = 0;
+            extra = 0;
+            while (refs)
+            {
+                bit = ctz(refs);
+                refs &= refs - 1;
+                nib = in[linkCursor] >> 4;
+                if (nib)
+                    cursorOut += nib + 2 - 1;
+                else
+                {
+                    /* Chunk bytes are the literals and extra lengths so far, in token order */
+                    cursorOut += (uint32_t)in[chunkCursor + bit - k + extra] + 0x12 - 1;
+                    extra++;
+                }
+                linkCursor += 2;
+                k++;
+            }
+            chunkCursor += 8 - k + extra;
+            cursorOut += 8;
+        }
+    }
+    return t;
+}
+
+int yaz0DecompressParallel(Yaz0BatchJob* job, int threads)
+{
+    Segment* segs;
+    uint32_t count;
+    int result;
+
+    if (!yaz0_StartJob(job))
+        return job->result;
+    if (threads < 1)
+        threads = 1;
+    count = (uint32_t)threads;
+    if (count > MAX_THREADS)
+        count = MAX_THREADS;
+    if (count > job->decompSize / SEGMENT_MIN_SIZE)
+        count = job->decompSize / SEGMENT_MIN_SIZE;
+    if (count < 1)
+        count = 1;
+
+    segs = calloc(count, sizeof(*segs));
+    if (!segs)
+    {
+        job->result = YAZ0_OUT_OF_MEMORY;
+        return job->result;
+    }
+    for (uint32_t t = 0; t < count; ++t)
+        flatInit(&segs[t].flat, job->in, job->sizeIn, job->out, job->decompSize, job->strict);
+    if (segs[0].flat.yay0)
+        count = scanSegmentsYay0(segs, count, job->in, job->sizeIn, job->decompSize);
+    else
+        count = scanSegments(segs, count, job->in, job->sizeIn, job->decompSize);
+    for (uint32_t t = 0; t < count; ++t)
+    {
+        segs[t].flat.cursorOut = segs[t].start;
+        segs[t].end = (t + 1 < count) ? segs[t + 1].start : job->decompSize;
+        if (t > 0)
+        {
+            /* Matches that reach before the segment wait for the fix-up pass */
+            segs[t].dirtyEnd = segs[t].start;
+            segs[t].defer = 1;
+        }
+    }
+    yaz0_RunTasks(decodeSegment, segs, sizeof(*segs), count);
+
+    /* Fix-up pass, in order, so every deferred reference reads final data */
+    result = YAZ0_OK;
+    for (uint32_t t = 0; t < count && result == YAZ0_OK; ++t)
+    {
+        for (uint32_t i = 0; i < segs[t].fixupCount; ++i)
+            copyMatch(job->out, segs[t].fixups[i].dst, segs[t].fixups[i].dist, segs[t].fixups[i].size);
+        if (segs[t].flat.result == YAZ0_OK && segs[t].flat.cursorOut < segs[t].end)
+        {
+            segs[t].defer = 0;
+            segs[t].dirtyEnd = 0;
+            decodeSegment(&segs[t]);
+        }
+        result = segs[t].flat.result;
+    }
+    if (result == YAZ0_OK && job->strict)
+        result = yaz0_CheckTrailing(job->in, flatEnd(&segs[count - 1].flat), job->sizeIn);
+    for (uint32_t t = 0; t < count; ++t)
+        free(segs[t].fixups);
+    free(segs);
+    job->result = result;
+    return result;
+}
@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include "libyaz0.h"
+#include "flat.h"
+
+/*
+ * Decode a Yaz0 stream, and record for every output byte the distance of
+ * the back-reference that produced it, or zero for a literal.
+ */
+typedef struct
+{
+    FlatDecoder     flat;
+    uint16_t*       hints;
+} HintDecoder;
+
+static __inline void hintLiterals(FlatDecoder* dec, uint32_t dst, uint32_t n)
+{
+    uint16_t* hints;
+
+    hints = ((HintDecoder*)dec)->hints;
+    for (uint32_t i = 0; i < n; ++i)
+        hints[dst + i] = 0;
+}
+
+static __inline void hintMatch(FlatDecoder* dec, uint32_t dst, uint32_t r, uint32_t n)
+{
+    uint16_t* hints;
+
+    hints = ((HintDecoder*)dec)->hints;
+    copyMatch(dec->out, dst, r, n);
+    /* References before the start of the data are no use as hints */
+    for (uint32_t i = 0; i < n; ++i)
+        hints[dst + i] = (uint16_t)(r <= dst ? r : 0);
+}
+
+static int decodeHints(const uint8_t* in, uint32_t sizeIn, uint8_t* out, uint16_t* hints, uint32_t size)
+{
+    HintDecoder dec;
+    int done;
+
+    flatInit(&dec.flat, in, sizeIn, out, size, 0);
+    dec.hints = hints;
+    done = !size;
+    while (!done)
+        done = flatDecodeGroup(&dec.flat, hintLiterals, hintMatch);
+    return dec.flat.result;
+}
+
+int yaz0Recompress(const void* in, uint32_t sizeIn, void* out, uint32_t sizeOut, uint32_t* outSize, int level)
+{
+    Yaz0Stream* s;
+    uint8_t* data;
+    uint16_t* hints;
+    uint8_t chunk[0x4000];
+    uint32_t size;
+    uint32_t total;
+    uint32_t n;
+    int ret;
+
+    *outSize = 0;
+    if (sizeIn < 16)
+        return YAZ0_NEED_AVAIL_IN;
+    if (memcmp(in, "Yaz0", 4))
+        return YAZ0_BAD_MAGIC;
+    size = read32((const uint8_t*)in + 4);
+
+    data = malloc(size ? size : 1);
+    hints = malloc(sizeof(*hints) * (size ? size : 1));
+    s = NULL;
+    ret = YAZ0_OUT_OF_MEMORY;
+    if (!data || !hints || yaz0Init(&s))
+        goto end;
+    ret = decodeHints(in, sizeIn, data, hints, size);
+    if (ret)
+        goto end;
+
+    yaz0ModeCompress(s, size, level);
+    yaz0_CompressHints(s, hints);
+    yaz0Input(s, data, size);
+
+    /*
+     * The compressor wants room for a whole group at all times, so it goes
+     * through a buffer of our own. That way the output can be sized to fit,
+     * and if it is too small we still finish, to tell how much is needed.
+     */
+    total = 0;
+    do
+    {
+        yaz0Output(s, chunk, sizeof(chunk));
+        ret = yaz0Run(s);
+        n = yaz0OutputChunkSize(s);
+        if (total < sizeOut)
+            memcpy((uint8_t*)out + total, chunk, n < sizeOut - total ? n : sizeOut - total);
+        total += n;
+    } while (ret == YAZ0_NEED_AVAIL_OUT);
+    if (ret == YAZ0_OK && total > sizeOut)
+        ret = YAZ0_NEED_AVAIL_OUT;
+    *outSize = total;
+
+end:
+    if (s)
+        yaz0Destroy(s);
+    free(hints);
+    free(data);
+    return ret;
+}
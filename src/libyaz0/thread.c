@@ -0,0 +1,315 @@
+#if defined(_WIN32)
+# include <windows.h>
+#else
+# include <pthread.h>
+# include <time.h>
+#endif
+#include "libyaz0.h"
+
+#if defined(_WIN32)
+typedef HANDLE              Thread;
+typedef SRWLOCK             Mutex;
+typedef CONDITION_VARIABLE  Cond;
+# define MUTEX_INIT         SRWLOCK_INIT
+# define COND_INIT          CONDITION_VARIABLE_INIT
+# define mutexLock(m)       AcquireSRWLockExclusive(m)
+# define mutexTryLock(m)    TryAcquireSRWLockExclusive(m)
+# define mutexUnlock(m)     ReleaseSRWLockExclusive(m)
+# define condWait(c, m)     SleepConditionVariableSRW((c), (m), INFINITE, 0)
+# define condBroadcast(c)   WakeAllConditionVariable(c)
+#else
+typedef pthread_t           Thread;
+typedef pthread_mutex_t     Mutex;
+typedef pthread_cond_t      Cond;
+# define MUTEX_INIT         PTHREAD_MUTEX_INITIALIZER
+# define COND_INIT          PTHREAD_COND_INITIALIZER
+# define mutexLock(m)       pthread_mutex_lock(m)
+# define mutexTryLock(m)    (pthread_mutex_trylock(m) == 0)
+# define mutexUnlock(m)     pthread_mutex_unlock(m)
+# define condWait(c, m)     pthread_cond_wait((c), (m))
+# define condBroadcast(c)   pthread_cond_broadcast(c)
+#endif
+
+typedef struct
+{
+    Yaz0TaskFunc    func;
+    void*           arg;
+} Task;
+
+/*
+ * Workers are started on first use and then kept, parked on a condition
+ * variable between calls, until yaz0StopThreads. Only one call uses the
+ * pool at a time, the others start their own threads. A child process
+ * gets none of the workers, so fork starts it with an empty pool.
+ */
+typedef struct
+{
+    Mutex           busy;
+    Mutex           lock;
+    Cond            wake;
+    Cond            done;
+    uint32_t        workers;
+    uint32_t        generation;
+    uint32_t        pending;
+    int             quit;
+    Yaz0TaskFunc    func;
+    uint8_t*        args;
+    size_t          argSize;
+    uint32_t        count;
+} Pool;
+
+typedef struct
+{
+    Thread          thread;
+    uint32_t        index;
+    uint32_t        generation;
+} Worker;
+
+static Pool gPool = { MUTEX_INIT, MUTEX_INIT, COND_INIT, COND_INIT, 0, 0, 0, 0, NULL, NULL, 0, 0 };
+static Worker gWorkers[MAX_THREADS];
+
+static void poolWorker(Worker* w)
+{
+    uint32_t index;
+    uint32_t generation;
+    Yaz0TaskFunc func;
+    void* arg;
+
+    mutexLock(&gPool.lock);
+    index = w->index;
+    generation = w->generation;
+    for (;;)
+    {
+        while (gPool.generation == generation)
+            condWait(&gPool.wake, &gPool.lock);
+        generation = gPool.generation;
+        if (gPool.quit)
+            break;
+        if (index >= gPool.count)
+            continue;
+        func = gPool.func;
+        arg = gPool.args + index * gPool.argSize;
+        mutexUnlock(&gPool.lock);
+        func(arg);
+        mutexLock(&gPool.lock);
+        if (--gPool.pending == 0)
+            condBroadcast(&gPool.done);
+    }
+    mutexUnlock(&gPool.lock);
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI poolMain(LPVOID ptr)
+{
+    poolWorker(ptr);
+    return 0;
+}
+
+static DWORD WINAPI taskMain(LPVOID ptr)
+{
+    Task* t = ptr;
+    t->func(t->arg);
+    return 0;
+}
+#else
+static void* poolMain(void* ptr)
+{
+    poolWorker(ptr);
+    return NULL;
+}
+
+static void* taskMain(void* ptr)
+{
+    Task* t = ptr;
+    t->func(t->arg);
+    return NULL;
+}
+#endif
+
+/* Start workers until there are enough for the tasks, returns how many there are */
+#if !defined(_WIN32)
+static pthread_once_t gForkOnce = PTHREAD_ONCE_INIT;
+
+/* Hold the pool still across fork, so the child gets it in a known state */
+static void forkPrepare(void)
+{
+    mutexLock(&gPool.busy);
+    mutexLock(&gPool.lock);
+}
+
+static void forkParent(void)
+{
+    mutexUnlock(&gPool.lock);
+    mutexUnlock(&gPool.busy);
+}
+
+static void forkChild(void)
+{
+    /* Only the forking thread lives on, the parked workers are gone */
+    gPool.workers = 0;
+    pthread_cond_init(&gPool.wake, NULL);
+    pthread_cond_init(&gPool.done, NULL);
+    mutexUnlock(&gPool.lock);
+    mutexUnlock(&gPool.busy);
+}
+
+static void forkRegister(void)
+{
+    pthread_atfork(forkPrepare, forkParent, forkChild);
+}
+#endif
+
+static uint32_t poolGrow(uint32_t count)
+{
+    uint32_t index;
+
+    /* Task 0 runs on the calling thread, worker i runs task i */
+    while (gPool.workers + 1 < count)
+    {
+        /* Started before the task is posted, so it waits for the next generation */
+        index = gPool.workers + 1;
+        gWorkers[index].index = index;
+        gWorkers[index].generation = gPool.generation;
+#if defined(_WIN32)
+        gWorkers[index].thread = CreateThread(NULL, 0, poolMain, &gWorkers[index], 0, NULL);
+        if (gWorkers[index].thread == NULL)
+            break;
+#else
+        if (pthread_create(&gWorkers[index].thread, NULL, poolMain, &gWorkers[index]))
+            break;
+#endif
+        gPool.workers++;
+    }
+    return gPool.workers + 1;
+}
+
+/* Fallback for concurrent callers - one short-lived thread per task */
+static void runThreads(Yaz0TaskFunc func, void* args, size_t argSize, uint32_t count)
+{
+    Task tasks[MAX_THREADS];
+    int started[MAX_THREADS];
+#if defined(_WIN32)
+    HANDLE threads[MAX_THREADS];
+#else
+    pthread_t threads[MAX_THREADS];
+#endif
+
+    for (uint32_t i = 1; i < count; ++i)
+    {
+        tasks[i].func = func;
+        tasks[i].arg = (uint8_t*)args + i * argSize;
+#if defined(_WIN32)
+        threads[i] = CreateThread(NULL, 0, taskMain, &tasks[i], 0, NULL);
+        started[i] = (threads[i] != NULL);
+#else
+        started[i] = (pthread_create(&threads[i], NULL, taskMain, &tasks[i]) == 0);
+#endif
+        /* If we can't get a thread, run it inline */
+        if (!started[i])
+            func(tasks[i].arg);
+    }
+    func(args);
+
+    for (uint32_t i = 1; i < count; ++i)
+    {
+        if (!started[i])
+            continue;
+#if defined(_WIN32)
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+}
+
+void yaz0_RunTasks(Yaz0TaskFunc func, void* args, size_t argSize, uint32_t count)
+{
+    uint32_t pooled;
+
+    if (count > MAX_THREADS)
+        count = MAX_THREADS;
+    if (count <= 1)
+    {
+        if (count)
+            func(args);
+        return;
+    }
+#if !defined(_WIN32)
+    pthread_once(&gForkOnce, forkRegister);
+#endif
+    if (!mutexTryLock(&gPool.busy))
+    {
+        runThreads(func, args, argSize, count);
+        return;
+    }
+
+    mutexLock(&gPool.lock);
+    pooled = poolGrow(count);
+    gPool.func = func;
+    gPool.args = args;
+    gPool.argSize = argSize;
+    gPool.count = pooled < count ? pooled : count;
+    gPool.pending = gPool.count - 1;
+    gPool.generation++;
+    condBroadcast(&gPool.wake);
+    mutexUnlock(&gPool.lock);
+
+    /* If we can't get enough workers, run the rest inline */
+    func(args);
+    for (uint32_t i = pooled; i < count; ++i)
+        func((uint8_t*)args + i * argSize);
+
+    mutexLock(&gPool.lock);
+    while (gPool.pending)
+        condWait(&gPool.done, &gPool.lock);
+    mutexUnlock(&gPool.lock);
+    mutexUnlock(&gPool.busy);
+}
+
+int yaz0StopThreads(void)
+{
+    uint32_t workers;
+
+    mutexLock(&gPool.busy);
+    mutexLock(&gPool.lock);
+    workers = gPool.workers;
+    gPool.quit = 1;
+    gPool.generation++;
+    condBroadcast(&gPool.wake);
+    mutexUnlock(&gPool.lock);
+
+    for (uint32_t i = 1; i <= workers; ++i)
+    {
+#if defined(_WIN32)
+        WaitForSingleObject(gWorkers[i].thread, INFINITE);
+        CloseHandle(gWorkers[i].thread);
+#else
+        pthread_join(gWorkers[i].thread, NULL);
+#endif
+    }
+
+    mutexLock(&gPool.lock);
+    gPool.workers = 0;
+    gPool.quit = 0;
+    mutexUnlock(&gPool.lock);
+    mutexUnlock(&gPool.busy);
+    return YAZ0_OK;
+}
+
+uint64_t yaz0_Now(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart * 1000000 + now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
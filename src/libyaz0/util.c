@@ -1,6 +1,61 @@
+#include <stdlib.h>
 #include "libyaz0.h"
 
 uint32_t swap32(uint32_t in)
 {
     return ((in & 0xFF) << 24) | ((in & 0xFF00) << 8) | ((in & 0xFF0000) >> 8) | ((in & 0xFF000000) >> 24);
 }
+
+/* Strict mode allows padding after the data, as long as it is zeroes */
+int yaz0_CheckTrailing(const uint8_t* in, uint32_t cursor, uint32_t size)
+{
+    for (; cursor < size; ++cursor)
+    {
+        if (in[cursor])
+            return YAZ0_BAD_DATA;
+    }
+    return YAZ0_OK;
+}
+
+int yaz0_BufferReserve(Yaz0Buffer* b, uint32_t size)
+{
+    uint8_t* data;
+    uint32_t capacity;
+
+    if (b->capacity - b->size >= size)
+        return YAZ0_OK;
+    capacity = b->capacity ? b->capacity : 0x1000;
+    while (capacity - b->size < size)
+    {
+        if (capacity > 0x7fffffff)
+            return YAZ0_OUT_OF_MEMORY;
+        capacity *= 2;
+    }
+    data = realloc(b->data, capacity);
+    if (!data)
+        return YAZ0_OUT_OF_MEMORY;
+    b->data = data;
+    b->capacity = capacity;
+    return YAZ0_OK;
+}
+
+int yaz0_BufferAppend(Yaz0Buffer* b, const void* data, uint32_t size)
+{
+    if (!size)
+        return YAZ0_OK;
+    if (yaz0_BufferReserve(b, size))
+        return YAZ0_OUT_OF_MEMORY;
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+    return YAZ0_OK;
+}
+
+void yaz0_FreeBuffers(Yaz0Stream* s)
+{
+    free(s->masks.data);
+    free(s->links.data);
+    free(s->chunks.data);
+    memset(&s->masks, 0, sizeof(s->masks));
+    memset(&s->links, 0, sizeof(s->links));
+    memset(&s->chunks, 0, sizeof(s->chunks));
+}
@@ -5,24 +5,50 @@
 
 #define BUFSIZE 0x1000
 
-static int run(const char* inPath, const char* outPath, int compress, int level)
+static void writeSink(void* userdata, const void* data, uint32_t size)
+{
+    fwrite(data, size, 1, (FILE*)userdata);
+}
+
+/* Pipes can't seek, so their size is only known once they end */
+static int inputSize(FILE* in, uint32_t* size)
+{
+    long off;
+
+    *size = YAZ0_SIZE_UNKNOWN;
+    if (fseek(in, 0, SEEK_END))
+        return 0;
+    off = ftell(in);
+    if (fseek(in, 0, SEEK_SET) || off < 0)
+        return 0;
+    if ((unsigned long)off >= YAZ0_SIZE_UNKNOWN)
+        return 1;
+    *size = (uint32_t)off;
+    return 0;
+}
+
+static int run(const char* inPath, const char* outPath, int compress, int yay0, int level, int strategy, int strict)
 {
     int ret;
     int err;
+    int inputEnd;
     size_t size;
-    off_t off;
+    uint32_t decompSize;
     FILE* in;
     FILE* out;
     Yaz0Stream* stream;
     char bufferIn[BUFSIZE];
     char bufferOut[BUFSIZE];
+    char header[16];
 
     in = NULL;
     out = NULL;
     stream = NULL;
 
     err = 0;
-    in = fopen(inPath, "rb");
+    inputEnd = 0;
+    decompSize = YAZ0_SIZE_UNKNOWN;
+    in = strcmp(inPath, "-") ? fopen(inPath, "rb") : stdin;
     if (!in)
     {
         fprintf(stderr, "Could not open `%s'\n", inPath);
@@ -44,26 +70,39 @@ static int run(const char* inPath, const char* outPath, int compress, int level)
     }
     if (compress)
     {
-        fseek(in, 0, SEEK_END);
-        off = ftell(in);
-        fseek(in, 0, SEEK_SET);
-        if (off > 0xffffffff)
+        if (inputSize(in, &decompSize))
         {
             fprintf(stderr, "%s: file too large\n", inPath);
             err = 1;
             goto end;
         }
-        ret = yaz0ModeCompress(stream, (uint32_t)off, level);
+        /* Otherwise the size is patched into the header once the input ends */
+        if (yay0)
+            ret = yay0ModeCompress(stream, decompSize, level);
+        else
+            ret = yaz0ModeCompress(stream, decompSize, level);
+        if (ret == YAZ0_OK)
+            ret = yaz0Strategy(stream, strategy);
     }
     else
-        ret = yaz0ModeDecompress(stream);
+    {
+        if (yay0)
+            ret = yay0ModeDecompress(stream);
+        else
+            ret = yaz0ModeDecompress(stream);
+        if (ret == YAZ0_OK)
+            ret = yaz0Strict(stream, strict);
+    }
     if (ret != YAZ0_OK)
     {
         fprintf(stderr, "Could not set libyaz0 mode\n");
         err = 1;
         goto end;
     }
-    yaz0Output(stream, bufferOut, BUFSIZE);
+    if (compress)
+        yaz0Output(stream, bufferOut, BUFSIZE);
+    else
+        yaz0OutputSink(stream, writeSink, out);
     size = fread(bufferIn, 1, BUFSIZE, in);
     yaz0Input(stream, bufferIn, (uint32_t)size);
     for (;;)
@@ -75,11 +114,21 @@ static int run(const char* inPath, const char* outPath, int compress, int level)
             fprintf(stderr, "%s: Bad magic\n", inPath);
             err = 1;
             goto end;
+        case YAZ0_BAD_DATA:
+            fprintf(stderr, "%s: Bad data\n", inPath);
+            err = 1;
+            goto end;
         case YAZ0_OK:
             goto last;
             break;
         case YAZ0_NEED_AVAIL_IN:
             size = fread(bufferIn, 1, BUFSIZE, in);
+            if (size == 0 && !inputEnd)
+            {
+                yaz0InputEnd(stream);
+                inputEnd = 1;
+                break;
+            }
             if (size == 0)
             {
                 fprintf(stderr, "%s: Abrupt end of file\n", inPath);
@@ -92,23 +141,269 @@ static int run(const char* inPath, const char* outPath, int compress, int level)
             fwrite(bufferOut, yaz0OutputChunkSize(stream), 1, out);
             yaz0Output(stream, bufferOut, BUFSIZE);
             break;
+        case YAZ0_OUT_OF_MEMORY:
+            fprintf(stderr, "Out of memory\n");
+            err = 1;
+            goto end;
+        default:
+            fprintf(stderr, "%s: Could not %s\n", inPath, compress ? "compress" : "decompress");
+            err = 1;
+            goto end;
         }
     }
 last:
     fwrite(bufferOut, yaz0OutputChunkSize(stream), 1, out);
+    if (compress && decompSize == YAZ0_SIZE_UNKNOWN)
+    {
+        if (yaz0Header(stream, header) != YAZ0_OK || fseek(out, 0, SEEK_SET) || fwrite(header, 16, 1, out) != 1)
+        {
+            fprintf(stderr, "%s: Could not write header\n", outPath);
+            err = 1;
+        }
+    }
 end:
     if (stream)
         yaz0Destroy(stream);
-    if (in)
+    if (in && in != stdin)
+        fclose(in);
+    if (out)
+        fclose(out);
+    return err;
+}
+
+static int readAll(const char* inPath, uint8_t** data, size_t* size)
+{
+    size_t ret;
+    int err;
+    size_t capacity;
+    FILE* in;
+    uint8_t* tmp;
+
+    *data = NULL;
+    *size = 0;
+    err = 0;
+    in = strcmp(inPath, "-") ? fopen(inPath, "rb") : stdin;
+    if (!in)
+    {
+        fprintf(stderr, "Could not open `%s'\n", inPath);
+        return 1;
+    }
+
+    capacity = 0;
+    for (;;)
+    {
+        if (*size == capacity)
+        {
+            capacity = capacity ? capacity * 2 : BUFSIZE;
+            tmp = realloc(*data, capacity);
+            if (!tmp)
+            {
+                fprintf(stderr, "Out of memory\n");
+                err = 1;
+                break;
+            }
+            *data = tmp;
+        }
+        ret = fread(*data + *size, 1, capacity - *size, in);
+        if (ret == 0)
+            break;
+        *size += ret;
+    }
+    if (!err && *size > 0xffffffff)
+    {
+        fprintf(stderr, "%s: file too large\n", inPath);
+        err = 1;
+    }
+    if (in != stdin)
         fclose(in);
+    return err;
+}
+
+static int runParallel(const char* inPath, const char* outPath, int threads, int strict)
+{
+    int ret;
+    int err;
+    size_t size;
+    FILE* out;
+    uint8_t* data;
+    Yaz0BatchJob job;
+
+    out = NULL;
+    memset(&job, 0, sizeof(job));
+
+    /* The whole stream has to be in memory */
+    err = readAll(inPath, &data, &size);
+    if (err)
+        goto end;
+
+    job.in = data;
+    job.sizeIn = (uint32_t)size;
+    job.strict = strict;
+    if (size >= 8)
+        job.sizeOut = ((uint32_t)data[4] << 24) | ((uint32_t)data[5] << 16) | ((uint32_t)data[6] << 8) | data[7];
+    job.out = malloc(job.sizeOut ? job.sizeOut : 1);
+    if (!job.out)
+    {
+        fprintf(stderr, "Out of memory\n");
+        err = 1;
+        goto end;
+    }
+    ret = yaz0DecompressParallel(&job, threads);
+    switch (ret)
+    {
+    case YAZ0_OK:
+        break;
+    case YAZ0_BAD_MAGIC:
+        fprintf(stderr, "%s: Bad magic\n", inPath);
+        err = 1;
+        goto end;
+    case YAZ0_NEED_AVAIL_IN:
+        fprintf(stderr, "%s: Abrupt end of file\n", inPath);
+        err = 1;
+        goto end;
+    case YAZ0_BAD_DATA:
+        fprintf(stderr, "%s: Bad data\n", inPath);
+        err = 1;
+        goto end;
+    default:
+        fprintf(stderr, "%s: Could not decompress\n", inPath);
+        err = 1;
+        goto end;
+    }
+
+    out = fopen(outPath, "wb");
+    if (!out)
+    {
+        fprintf(stderr, "Could not open `%s'\n", outPath);
+        err = 1;
+        goto end;
+    }
+    fwrite(job.out, job.decompSize, 1, out);
+end:
+    free(job.out);
+    free(data);
     if (out)
         fclose(out);
     return err;
 }
 
+static int runRecompress(const char* inPath, const char* outPath, int level)
+{
+    int ret;
+    int err;
+    size_t size;
+    uint32_t decompSize;
+    uint32_t capacity;
+    uint32_t outSize;
+    FILE* out;
+    uint8_t* data;
+    uint8_t* buffer;
+
+    out = NULL;
+    buffer = NULL;
+    err = readAll(inPath, &data, &size);
+    if (err)
+        goto end;
+
+    /* Room for all literals, it tells us if it needs more */
+    decompSize = 0;
+    if (size >= 8)
+        decompSize = ((uint32_t)data[4] << 24) | ((uint32_t)data[5] << 16) | ((uint32_t)data[6] << 8) | data[7];
+    capacity = decompSize + decompSize / 8 + 64;
+    buffer = malloc(capacity);
+    if (!buffer || capacity < decompSize)
+    {
+        fprintf(stderr, "Out of memory\n");
+        err = 1;
+        goto end;
+    }
+    ret = yaz0Recompress(data, (uint32_t)size, buffer, capacity, &outSize, level);
+    if (ret == YAZ0_NEED_AVAIL_OUT)
+    {
+        /* outSize is how much it needs */
+        free(buffer);
+        capacity = outSize;
+        buffer = malloc(capacity);
+        if (!buffer)
+        {
+            fprintf(stderr, "Out of memory\n");
+            err = 1;
+            goto end;
+        }
+        ret = yaz0Recompress(data, (uint32_t)size, buffer, capacity, &outSize, level);
+    }
+    switch (ret)
+    {
+    case YAZ0_OK:
+        break;
+    case YAZ0_BAD_MAGIC:
+        fprintf(stderr, "%s: Bad magic\n", inPath);
+        err = 1;
+        goto end;
+    case YAZ0_NEED_AVAIL_IN:
+        fprintf(stderr, "%s: Abrupt end of file\n", inPath);
+        err = 1;
+        goto end;
+    case YAZ0_OUT_OF_MEMORY:
+        fprintf(stderr, "Out of memory\n");
+        err = 1;
+        goto end;
+    default:
+        fprintf(stderr, "%s: Could not recompress\n", inPath);
+        err = 1;
+        goto end;
+    }
+
+    out = fopen(outPath, "wb");
+    if (!out)
+    {
+        fprintf(stderr, "Could not open `%s'\n", outPath);
+        err = 1;
+        goto end;
+    }
+    fwrite(buffer, outSize, 1, out);
+end:
+    free(buffer);
+    free(data);
+    if (out)
+        fclose(out);
+    return err;
+}
+
+static int runEstimate(const char* inPath)
+{
+    int err;
+    size_t size;
+    uint8_t* data;
+    Yaz0Estimate estimate;
+
+    err = readAll(inPath, &data, &size);
+    if (err)
+    {
+        free(data);
+        return err;
+    }
+    printf("level       size   ratio        time\n");
+    for (int level = 1; level <= YAZ0_MAX_LEVEL; ++level)
+    {
+        if (yaz0Estimate(data, (uint32_t)size, level, &estimate) != YAZ0_OK)
+        {
+            fprintf(stderr, "%s: Could not estimate\n", inPath);
+            err = 1;
+            break;
+        }
+        printf("%5d %10u %6.1f%% %8.1f ms\n", level, estimate.size, size ? 100.0 * estimate.size / (double)size : 100.0, estimate.time / 1000.0);
+    }
+    free(data);
+    return err;
+}
+
 static void usage(const char* program)
 {
-    printf("usage: %s [-d] [-l level] [-o output] input\n", program);
+    printf("usage: %s [-d] [-f yaz0|yay0] [-j threads] [-l level] [--fast-decode] [--strict] [-o output] input\n", program);
+    printf("       %s --estimate input\n", program);
+    printf("       %s --recompress [-l level] -o output input\n", program);
+    printf("       use - as input to read from stdin (requires -o)\n");
 }
 
 int main(int argc, char** argv)
@@ -118,15 +413,27 @@ int main(int argc, char** argv)
     int compress;
     int autoOutFile;
     int level;
+    int strategy;
+    int threads;
+    int yay0;
+    int estimate;
+    int strict;
+    int recompress;
 
     inFile = NULL;
     compress = 1;
     autoOutFile = 1;
     level = YAZ0_DEFAULT_LEVEL;
+    strategy = YAZ0_STRATEGY_DEFAULT;
+    threads = 1;
+    yay0 = 0;
+    estimate = 0;
+    strict = 0;
+    recompress = 0;
 
     for (int i = 1; i < argc; ++i)
     {
-        if (argv[i][0] == '-')
+        if (argv[i][0] == '-' && argv[i][1])
         {
             if (strcmp(argv[i], "-d") == 0)
             {
@@ -153,6 +460,50 @@ int main(int argc, char** argv)
                 }
                 level = atoi(argv[i]);
             }
+            else if (strcmp(argv[i], "-f") == 0)
+            {
+                i++;
+                if (argc == i || (strlen(argv[i]) == 0))
+                {
+                    fprintf(stderr, "Missing argument for -f\n");
+                    return 1;
+                }
+                if (strcmp(argv[i], "yay0") == 0)
+                    yay0 = 1;
+                else if (strcmp(argv[i], "yaz0") == 0)
+                    yay0 = 0;
+                else
+                {
+                    fprintf(stderr, "Unknown format `%s'\n", argv[i]);
+                    return 1;
+                }
+            }
+            else if (strcmp(argv[i], "-j") == 0)
+            {
+                i++;
+                if (argc == i || (strlen(argv[i]) == 0))
+                {
+                    fprintf(stderr, "Missing argument for -j\n");
+                    return 1;
+                }
+                threads = atoi(argv[i]);
+            }
+            else if (strcmp(argv[i], "--fast-decode") == 0)
+            {
+                strategy = YAZ0_STRATEGY_DECODE_SPEED;
+            }
+            else if (strcmp(argv[i], "--estimate") == 0)
+            {
+                estimate = 1;
+            }
+            else if (strcmp(argv[i], "--strict") == 0)
+            {
+                strict = 1;
+            }
+            else if (strcmp(argv[i], "--recompress") == 0)
+            {
+                recompress = 1;
+            }
             else
             {
                 usage(argv[0]);
@@ -177,19 +528,41 @@ int main(int argc, char** argv)
         return 0;
     }
 
+    if (estimate)
+        return runEstimate(inFile);
+
+    /* The input is already a .yaz0 file, so there is no good default name */
+    if (recompress)
+    {
+        if (autoOutFile)
+        {
+            fprintf(stderr, "Recompressing requires -o\n");
+            return 1;
+        }
+        return runRecompress(inFile, outFile, level);
+    }
+
+    if (autoOutFile && !strcmp(inFile, "-"))
+    {
+        fprintf(stderr, "Reading from stdin requires -o\n");
+        return 1;
+    }
+
     if (autoOutFile)
     {
         strcpy(outFile, inFile);
         if (compress)
-            strcat(outFile, ".yaz0");
+            strcat(outFile, yay0 ? ".yay0" : ".yaz0");
         else
         {
             char* ext = strrchr(outFile, '.');
-            if (ext && !strcmp(ext, ".yaz0"))
+            if (ext && !strcmp(ext, yay0 ? ".yay0" : ".yaz0"))
                 *ext = 0;
             else
                 strcat(outFile, ".out");
         }
     }
-    return run(inFile, outFile, compress, level);
+    if (!compress && threads > 1)
+        return runParallel(inFile, outFile, threads, strict);
+    return run(inFile, outFile, compress, yay0, level, strategy, strict);
 }